@@ -11,14 +11,26 @@
  *   Copyright (c) 2018 Patong Yang <patong.mxl@gmail.com>
  */
 
+#include <linux/ctype.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/fault-inject.h>
+#include <linux/hrtimer.h>
 #include <linux/kernel.h>
+#include <linux/kfifo.h>
 #include <linux/module.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/tty.h>
+#include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/usb/cdc.h>
 #include <linux/usb/serial.h>
 
+#include "xr_serial.h"
+
 struct xr_txrx_clk_mask {
 	u16 tx;
 	u16 rx0;
@@ -97,6 +109,7 @@ struct xr_txrx_clk_mask {
 #define CDC_DATA_INTERFACE_TYPE		0x0a
 
 #define VIA_CDC_REGISTER		-1
+#define NOT_SUPPORTED			-2
 
 enum xr_model {
 	XR2280X,
@@ -197,6 +210,11 @@ static const int xr_hal_table[MAX_XR_MODELS][MAX_XR_HAL_TYPE] = {
 		[REG_GPIO_SET] =			0x1d,
 		[REG_GPIO_CLR] =			0x1e,
 		[REG_GPIO_STATUS] =			0x1f,
+		[REG_CUSTOMIZED_INT] =			NOT_SUPPORTED,
+		[REG_GPIO_PULL_UP_ENABLE] =		NOT_SUPPORTED,
+		[REG_GPIO_PULL_DOWN_ENABLE] =		NOT_SUPPORTED,
+		[REG_LOW_LATENCY] =			NOT_SUPPORTED,
+		[REG_CUSTOM_DRIVER] =			NOT_SUPPORTED,
 
 		[REQ_SET] =				0,
 		[REQ_GET] =				1,
@@ -227,688 +245,5447 @@ static const int xr_hal_table[MAX_XR_MODELS][MAX_XR_HAL_TYPE] = {
 	}
 };
 
+/* Adaptive modem status polling interval bounds */
+#define XR_MSR_POLL_MIN_MS		10
+#define XR_MSR_POLL_MAX_MS		500
+
+/* Most delimiters a port may hold back its RX data for, see xr_rx_hold() */
+#define XR_RX_MAX_DELIMS		4
+
+static unsigned int lazy_config_ms;
+module_param(lazy_config_ms, uint, 0644);
+MODULE_PARM_DESC(lazy_config_ms,
+		 "Defer UART setup at open until the first write, or for at most this many ms (0 = setup at open)");
+
+static unsigned int rx_budget_kbps;
+module_param(rx_budget_kbps, uint, 0644);
+MODULE_PARM_DESC(rx_budget_kbps,
+		 "Bulk-in budget shared by all ports in kB/s, enforced by weight once used up (0 = unlimited)");
+
+/* Defaults applied on the first open of each channel */
+static unsigned int default_baud;
+module_param(default_baud, uint, 0444);
+MODULE_PARM_DESC(default_baud, "Initial baud rate (0 = tty default)");
+
+static char *default_format;
+module_param(default_format, charp, 0444);
+MODULE_PARM_DESC(default_format, "Initial character format, like 8N1 or 7E2");
+
+static char *default_flow;
+module_param(default_flow, charp, 0444);
+MODULE_PARM_DESC(default_flow, "Initial flow control: none, rtscts or xonxoff");
+
+static bool default_low_latency;
+module_param(default_low_latency, bool, 0444);
+MODULE_PARM_DESC(default_low_latency, "Enable the low latency mode, where supported");
+
+static bool default_rs485;
+module_param(default_rs485, bool, 0444);
+MODULE_PARM_DESC(default_rs485, "Drive RTS as RS-485 transmitter enable");
+
+static unsigned int default_rs485_delay;
+module_param(default_rs485_delay, uint, 0444);
+MODULE_PARM_DESC(default_rs485_delay, "RS-485 turnaround delay, in bit times");
+
+enum xr_flow {
+	XR_FLOW_NONE,
+	XR_FLOW_RTSCTS,
+	XR_FLOW_XONXOFF,
+};
+
+static const char * const xr_flow_names[] = {
+	[XR_FLOW_NONE] =	"none",
+	[XR_FLOW_RTSCTS] =	"rtscts",
+	[XR_FLOW_XONXOFF] =	"xonxoff",
+};
+
+#define XR_FORMAT_CFLAGS	(CSIZE | PARENB | PARODD | CMSPAR | CSTOPB)
+
+enum xr_op {
+	XR_OP_OPEN,
+	XR_OP_SET_TERMIOS,
+	XR_OP_RX_RECOVERY,
+	XR_OP_TX_RECOVERY,
+	XR_OP_WEDGE_RECOVERY,
+	XR_OP_MAX
+};
+
+static const char * const xr_op_names[] = {
+	[XR_OP_OPEN] =		"open",
+	[XR_OP_SET_TERMIOS] =	"set_termios",
+	[XR_OP_RX_RECOVERY] =	"rx_recovery",
+	[XR_OP_TX_RECOVERY] =	"tx_recovery",
+	[XR_OP_WEDGE_RECOVERY] =	"wedge",
+};
+
+struct xr_op_stats {
+	u64 count;
+	u64 errors;
+	u64 last_ns;
+	u64 max_ns;
+	u64 total_ns;
+	u64 ctrl_vendor;
+	u64 ctrl_cdc;
+};
+
+/* Where an operation started, see xr_op_begin() */
+struct xr_op_mark {
+	ktime_t start;
+	s64 ctrl;
+	s64 ctrl_cdc;
+	s64 ctrl_errors;
+};
+
+/* Log2 latency histogram, bucket i counts samples of [2^i, 2^(i+1)) ns */
+#define XR_HIST_BUCKETS		36
+
+struct xr_hist {
+	atomic_long_t bucket[XR_HIST_BUCKETS];
+};
+
+enum xr_autobaud_state {
+	XR_AB_IDLE,
+	XR_AB_RUNNING,
+	XR_AB_LOCKED,
+	XR_AB_FAILED,
+};
+
+/*
+ * Short-window rates, see xr_rate_slot(): the last XR_RATE_SLOTS slots of
+ * 100 ms each, every slot tagged with the period it counts.
+ */
+#define XR_RATE_SLOTS		64
+#define XR_RATE_SLOT_JIFFIES	(HZ / 10)
+
+enum xr_rate {
+	XR_RATE_RX_BYTES,
+	XR_RATE_RX_URBS,
+	XR_RATE_TX_BYTES,
+	XR_RATE_TX_URBS,
+	XR_RATE_ERRORS,
+	XR_RATE_MAX
+};
+
+struct xr_rate_slot {
+	atomic_long_t epoch;
+	atomic_t val[XR_RATE_MAX];
+};
+
+/* Per-port traffic and contention counters, updated without locking */
+struct xr_counters {
+	atomic64_t rx_bytes;
+	atomic64_t rx_urbs;
+	atomic64_t rx_ns;
+	atomic64_t rx_pushes;
+	atomic64_t rx_paced;
+	atomic64_t rx_arbitrated;
+	atomic64_t tx_bytes;
+	atomic64_t tx_urbs;
+	atomic64_t ctrl_xfers;
+	atomic64_t ctrl_cdc;
+	atomic64_t ctrl_errors;
+	atomic64_t ctrl_ns;
+	atomic64_t cfg_contended;
+	atomic64_t cfg_wait_ns;
+	atomic64_t wedges;
+	atomic64_t recover_clear_halt;
+	atomic64_t recover_reinit;
+	atomic64_t recover_reset;
+	atomic64_t echo_bytes;
+	atomic64_t echo_collisions;
+	atomic64_t echo_lost;
+	atomic64_t bridge_bytes;
+	atomic64_t bridge_drops;
+	atomic64_t bridge_throttles;
+};
+
 struct xr_port_private {
 	enum xr_model model;
 	unsigned int channel;
 	struct usb_interface *control_if;
+	struct usb_serial_port *port;
+
+	/* Set while an ioctl owns the transmitter, protected by port->lock */
+	bool tx_claimed;
+
+	/* Modem status poller, protected by msr_lock */
+	spinlock_t msr_lock;
+	struct delayed_work msr_work;
+	unsigned int msr_interval;
+	unsigned int msr_waiters;
+	bool msr_watch_cd;
+	bool msr_valid;
+	u8 msr;
+
+	/* Deferred hardware setup, protected by cfg_lock */
+	struct mutex cfg_lock;
+	struct delayed_work cfg_work;
+	bool cfg_pending;
+	unsigned int cfg_mctrl_set;
+	unsigned int cfg_mctrl_clear;
+
+	/* Settings from module parameters or sysfs, applied on open */
+	unsigned int def_baud;
+	tcflag_t def_cflag;
+	bool def_format;
+	int def_flow;
+	bool def_applied;
+	bool low_latency;
+	bool rs485;
+	u8 rs485_delay;
+
+	struct dentry *debugfs;
+
+	/* Reasons to stop reading besides a tty throttle, see xr_rx_stopped() */
+	unsigned long rx_stop;
+
+	/* RX processing off the URB completion, see xr_rx_work() */
+	struct work_struct rx_work;
+	struct kfifo rx_fifo;
+	spinlock_t rx_lock;
+	int rx_cpu;
+	bool rx_workqueue;
+	bool rx_defer;
+
+	/* Delimiter mode, protected by rx_hold_lock, see xr_rx_hold() */
+	spinlock_t rx_hold_lock;
+	struct hrtimer rx_hold_timer;
+	u8 rx_delim[XR_RX_MAX_DELIMS];
+	unsigned int rx_ndelim;
+	unsigned int rx_hold_bytes;
+	unsigned int rx_hold_us;
+	unsigned int rx_held;
+
+	/* Bulk-in share, see xr_rx_resubmit_ns() */
+	struct hrtimer rx_pace_timer;
+	ktime_t rx_pace_start;
+	unsigned int rx_urbs;
+	unsigned int rx_urb_size;
+	unsigned int rx_pace_us;
+	unsigned int rx_weight;
+	bool rx_weighted;
+
+	/* RS-485 echo suppression, protected by echo_lock */
+	spinlock_t echo_lock;
+	struct kfifo echo_fifo;
+	ktime_t echo_deadline;
+	bool rs485_echo;
+
+	/* Wedge detection and recovery, see xr_health_work() */
+	struct delayed_work health_work;
+	unsigned long health_flags;
+	atomic_t ctrl_timeouts;
+	atomic_t bulk_errors;
+	unsigned int health_level;
+	unsigned long health_last;
+	unsigned int health_silent;
+	s64 health_rx;
+	u8 health_msr;
+	bool health_msr_valid;
+	unsigned int mctrl;
+	bool recovery_reset;
+	bool recovery_silent;
+
+	/* Automatic baud rate detection, see xr_autobaud_work() */
+	struct work_struct ab_work;
+	unsigned int ab_dwell_ms;
+	enum xr_autobaud_state ab_state;
+	u32 ab_baud;
+	bool ab_abort;
+	bool ab_overridden;
+	bool ab_sampling;
+	atomic_t ab_bytes;
+	atomic_t ab_suspect;
+
+	/* In-kernel forwarding to another port, see xr_bridge_rx() */
+	struct xr_port_private __rcu *bridge;
+
+	/* Duration statistics, protected by stats_lock */
+	spinlock_t stats_lock;
+	struct xr_op_stats op_stats[XR_OP_MAX];
+	ktime_t rx_fail_start;
+	ktime_t tx_fail_start;
+
+	/* Transmitter drain estimate, protected by port->lock */
+	wait_queue_head_t tx_wait;
+	u64 tx_char_ns;
+	ktime_t tx_urb_done;
+	ktime_t tx_done;
+
+	/* Group transfers using the channel, see xr_group_tx() */
+	atomic_t group_refs;
+
+	struct xr_counters cnt;
+	struct xr_hist ctrl_hist;
+	struct xr_hist rx_hist;
+	struct xr_hist svc_hist;
+	struct xr_rate_slot rates[XR_RATE_SLOTS];
+	struct list_head node;
+
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+	/* Fault injection knobs, see xr_fault_debugfs_init() */
+	struct fault_attr fail_ctrl;
+	struct fault_attr fail_rx;
+	u32 fault_ctrl_delay_us;
+	u32 fault_stall_reg;
+	bool fault_unplugged;
+#endif
 };
 
-static int xr_set_reg(struct usb_serial_port *port, u8 block, u8 reg, u8 val)
-{
-	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	struct usb_serial *serial = port->serial;
-	int ret;
+static struct dentry *xr_debugfs_root;
 
-	switch (port_priv->model) {
-	case XR2280X:
-	case XR21B1411:
-		break;
-	case XR21V141X:
-		if (port_priv->channel)
-			reg |= (port_priv->channel - 1) << 8;
-		break;
-	case XR21B142X:
-		reg |= (port_priv->channel - 4) << 1;
-		break;
-	default:
-		return -EINVAL;
-	};
-	ret = usb_control_msg(serial->dev,
-			      usb_sndctrlpipe(serial->dev, 0),
-			      xr_hal_table[port_priv->model][REQ_SET],
-			      USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-			      val, reg | (block << 8), NULL, 0,
-			      USB_CTRL_SET_TIMEOUT);
-	if (ret < 0) {
-		dev_err(&port->dev, "Failed to set reg 0x%02x: %d\n", reg, ret);
-		return ret;
-	}
+/* High priority workqueue for the ports that defer their RX processing */
+static struct workqueue_struct *xr_rx_wq;
 
-	return 0;
-}
+#define XR_RX_FIFO_SIZE		8192
 
-static int xr_get_reg(struct usb_serial_port *port, u8 block, u8 reg, u8 *val)
-{
-	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	struct usb_serial *serial = port->serial;
-	u8 *dmabuf;
-	int ret;
+/* All bound ports, for the driver-wide views */
+static LIST_HEAD(xr_port_list);
+static DEFINE_MUTEX(xr_port_list_lock);
 
-	dmabuf = kmalloc(1, GFP_KERNEL);
-	if (!dmabuf)
-		return -ENOMEM;
+/* URBs allocated by the driver itself, outside of the usb-serial core */
+static atomic_t xr_live_urbs = ATOMIC_INIT(0);
 
-	switch (port_priv->model) {
-	case XR2280X:
-	case XR21B1411:
-		break;
-	case XR21V141X:
-		if (port_priv->channel)
-			reg |= (port_priv->channel - 1) << 8;
-		break;
-	case XR21B142X:
-		reg |= (port_priv->channel - 4) << 1;
-		break;
-	default:
-		return -EINVAL;
-	};
-	ret = usb_control_msg(serial->dev,
-			      usb_rcvctrlpipe(serial->dev, 0),
-			      xr_hal_table[port_priv->model][REQ_GET],
-			      USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-			      0, reg | (block << 8), dmabuf, 1,
-			      USB_CTRL_GET_TIMEOUT);
-	if (ret == 1) {
-		*val = *dmabuf;
-		ret = 0;
-	} else {
-		dev_err(&port->dev, "Failed to get reg 0x%02x: %d\n", reg, ret);
-		if (ret >= 0)
-			ret = -EIO;
-	}
+static struct urb *xr_alloc_urb(gfp_t mem_flags)
+{
+	struct urb *urb = usb_alloc_urb(0, mem_flags);
 
-	kfree(dmabuf);
+	if (urb)
+		atomic_inc(&xr_live_urbs);
 
-	return ret;
+	return urb;
 }
 
-static int xr_usb_serial_ctrl_msg(struct usb_serial_port *port,
-				  int request, int val,
-				  void *buf, int len)
+static void xr_free_urb(struct urb *urb)
 {
-	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	int if_num = port_priv->control_if->altsetting[0].desc.bInterfaceNumber;
-	struct usb_serial *serial = port->serial;
-	u8 *dmabuf = NULL;
-	int ret;
-
-	if (len) {
-		dmabuf = kmemdup(buf, len, GFP_KERNEL);
-		if (!dmabuf)
-			return -ENOMEM;
-	}
+	if (!urb)
+		return;
 
-	ret = usb_control_msg(serial->dev,
-			      usb_rcvctrlpipe(serial->dev, 0),
-			      request,
-			      USB_TYPE_CLASS | USB_RECIP_INTERFACE,
-			      val,
-			      if_num, dmabuf, len,
-			      USB_CTRL_GET_TIMEOUT);
+	usb_free_urb(urb);
+	atomic_dec(&xr_live_urbs);
+}
 
-	if (ret < 0) {
-		dev_err(&port->dev, "Failed to send a control msg: %d\n", ret);
-	} else {
-		if (dmabuf)
-			memcpy(buf, dmabuf, len);
-		ret = 0;
-	}
+static void xr_hist_add(struct xr_hist *hist, u64 ns)
+{
+	unsigned int i = 0;
 
-	kfree(dmabuf);
+	if (ns)
+		i = min_t(unsigned int, ilog2(ns), XR_HIST_BUCKETS - 1);
 
-	return ret;
+	atomic_long_inc(&hist->bucket[i]);
 }
 
-static int xr_set_reg_uart(struct usb_serial_port *port, u8 reg, u8 val)
+/*
+ * The completion paths only use atomics on the slot of the current period.
+ * Whoever first moves a slot to a new period clears it, so a few counts of
+ * a racing completion may be lost at a slot boundary, which is fine for
+ * rates.
+ */
+static struct xr_rate_slot *xr_rate_slot(struct xr_port_private *port_priv)
 {
-	return xr_set_reg(port, UART_REG_BLOCK, reg, val);
-}
+	unsigned long epoch = jiffies / XR_RATE_SLOT_JIFFIES;
+	struct xr_rate_slot *slot = &port_priv->rates[epoch % XR_RATE_SLOTS];
+	unsigned long old = atomic_long_read(&slot->epoch);
+	int i;
+
+	if (old != epoch &&
+	    atomic_long_cmpxchg(&slot->epoch, old, epoch) == old) {
+		for (i = 0; i < XR_RATE_MAX; i++)
+			atomic_set(&slot->val[i], 0);
+	}
 
-static int xr_get_reg_uart(struct usb_serial_port *port, u8 reg, u8 *val)
-{
-	return xr_get_reg(port, UART_REG_BLOCK, reg, val);
+	return slot;
 }
 
-static int xr_set_reg_um(struct usb_serial_port *port, u8 reg, u8 val)
+static void xr_rate_transfer(struct xr_port_private *port_priv, bool tx,
+			     unsigned int len)
 {
-	return xr_set_reg(port, UM_REG_BLOCK, reg, val);
+	struct xr_rate_slot *slot = xr_rate_slot(port_priv);
+
+	atomic_add(len, &slot->val[tx ? XR_RATE_TX_BYTES : XR_RATE_RX_BYTES]);
+	atomic_inc(&slot->val[tx ? XR_RATE_TX_URBS : XR_RATE_RX_URBS]);
 }
 
 /*
- * According to datasheet, below is the recommended sequence for enabling UART
- * module in XR21V141X:
- *
- * Enable Tx FIFO
- * Enable Tx and Rx
- * Enable Rx FIFO
+ * Every pending bulk-in URB keeps the host controller polling the device,
+ * which adds up with many ports behind one hub. Each port has a number of
+ * URBs in flight, a transfer size and a minimum time between a completion
+ * and the next submission. On top of that, rx_budget_kbps caps what all
+ * the ports receive together: once the current rate slot used it up, a
+ * port that got more than its weighted share of it waits for the next
+ * slot. Below the budget nothing is held back.
  */
-static int xr_uart_enable(struct usb_serial_port *port)
+#define XR_RX_WEIGHT_MAX	100
+#define XR_RX_PACE_MAX_US	100000
+
+static DEFINE_SPINLOCK(xr_rx_share_lock);
+static unsigned int xr_rx_weights;
+
+static struct {
+	atomic_long_t epoch;
+	atomic_t bytes;
+} xr_rx_window;
+
+/* Counts the weight of a port while it is open */
+static void xr_rx_share_join(struct xr_port_private *port_priv, bool join)
 {
-	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	int ret;
+	spin_lock(&xr_rx_share_lock);
+	if (port_priv->rx_weighted != join) {
+		port_priv->rx_weighted = join;
+		if (join)
+			xr_rx_weights += port_priv->rx_weight;
+		else
+			xr_rx_weights -= port_priv->rx_weight;
+	}
+	spin_unlock(&xr_rx_share_lock);
+}
 
-	if (port_priv->model != XR21V141X)
-		return xr_set_reg_uart(port,
-				       xr_hal_table[port_priv->model][REG_ENABLE],
-				       UART_ENABLE_TX | UART_ENABLE_RX);
+/* Returns how long to wait before resubmitting a bulk-in URB */
+static u64 xr_rx_resubmit_ns(struct xr_port_private *port_priv,
+			     unsigned int len)
+{
+	u64 budget = (u64)READ_ONCE(rx_budget_kbps) * 1000 / 10;
+	u64 ns = (u64)READ_ONCE(port_priv->rx_pace_us) * NSEC_PER_USEC;
+	unsigned long epoch = jiffies / XR_RATE_SLOT_JIFFIES;
+	unsigned long old = atomic_long_read(&xr_rx_window.epoch);
+	unsigned int weights, mine;
+	u64 share;
 
-	ret = xr_set_reg_um(port, UM_FIFO_ENABLE_REG,
-			    UM_ENABLE_TX_FIFO);
-	if (ret)
-		return ret;
+	if (ns)
+		atomic64_inc(&port_priv->cnt.rx_paced);
 
-	ret = xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_ENABLE],
-			      UART_ENABLE_TX | UART_ENABLE_RX);
-	if (ret)
-		return ret;
+	if (!budget)
+		return ns;
 
-	ret = xr_set_reg_um(port, UM_FIFO_ENABLE_REG,
-			    UM_ENABLE_TX_FIFO | UM_ENABLE_RX_FIFO);
+	if (old != epoch &&
+	    atomic_long_cmpxchg(&xr_rx_window.epoch, old, epoch) == old)
+		atomic_set(&xr_rx_window.bytes, 0);
 
-	if (ret)
-		xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_ENABLE], 0);
+	if (atomic_add_return(len, &xr_rx_window.bytes) <= budget)
+		return ns;
 
-	return ret;
-}
+	/* This URB is already in the rates */
+	mine = atomic_read(&xr_rate_slot(port_priv)->val[XR_RATE_RX_BYTES]);
+	weights = max(READ_ONCE(xr_rx_weights), 1U);
+	share = div_u64(budget * READ_ONCE(port_priv->rx_weight), weights);
+	if (mine <= share)
+		return ns;
 
-static int xr_uart_disable(struct usb_serial_port *port)
-{
-	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	int ret;
+	atomic64_inc(&port_priv->cnt.rx_arbitrated);
 
-	ret = xr_set_reg_uart(port,
-			      xr_hal_table[port_priv->model][REG_ENABLE], 0);
-	if (ret)
-		return ret;
+	return max(ns, jiffies_to_nsecs((epoch + 1) * XR_RATE_SLOT_JIFFIES -
+					jiffies));
+}
 
-	if (port_priv->model != XR21V141X)
-		return 0;
+/*
+ * Besides a tty throttle, reading stops while the RX work is behind, see
+ * xr_rx_queue(), or the bridge peer can't take more data, see
+ * xr_bridge_rx(). Each of them has a bit of its own in rx_stop.
+ */
+#define XR_RX_STOP_FIFO		0
+#define XR_RX_STOP_BRIDGE	1
 
-	ret = xr_set_reg_um(port, UM_FIFO_ENABLE_REG, 0);
+static bool xr_rx_stopped(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
 
-	return ret;
+	return test_bit(USB_SERIAL_THROTTLED, &port->flags) ||
+	       READ_ONCE(port_priv->rx_stop);
 }
 
-static int fifo_reset(struct usb_serial_port *port)
+static int xr_submit_read_urb(struct usb_serial_port *port, unsigned int i,
+			      gfp_t mem_flags)
 {
 	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	int channel = port_priv->channel;
-	int ret = 0;
+	struct urb *urb = port->read_urbs[i];
+	int ret;
 
-	if (port_priv->model != XR21V141X)
+	if (!test_and_clear_bit(i, &port->read_urbs_free))
 		return 0;
 
-	if (channel)
-		channel--;
-
-	ret = xr_set_reg_um(port,
-			    URM_RESET_RX_FIFO_BASE + channel, 0xff);
-	if (ret)
-		return ret;
+	urb->transfer_buffer_length = READ_ONCE(port_priv->rx_urb_size);
 
-	ret = xr_set_reg_um(port,
-			    URM_RESET_TX_FIFO_BASE + channel, 0xff);
+	ret = usb_submit_urb(urb, mem_flags);
+	if (ret) {
+		if (ret != -EPERM && ret != -ENODEV)
+			dev_err(&port->dev, "%s - usb_submit_urb failed: %d\n",
+				__func__, ret);
+		set_bit(i, &port->read_urbs_free);
+	}
 
 	return ret;
 }
 
-static int xr_tiocmget(struct tty_struct *tty)
+/* Submits the free bulk-in URBs the port may have in flight */
+static int xr_submit_read_urbs(struct usb_serial_port *port, gfp_t mem_flags)
 {
-	struct usb_serial_port *port = tty->driver_data;
 	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	u8 status;
+	unsigned int i, n = READ_ONCE(port_priv->rx_urbs);
 	int ret;
 
-	ret = xr_get_reg_uart(port,
-			      xr_hal_table[port_priv->model][REG_GPIO_STATUS],
-			      &status);
-	if (ret)
-		return ret;
-
-	/*
-	 * Modem control pins are active low, so reading '0' means it is active
-	 * and '1' means not active.
-	 */
-	ret = ((status & UART_MODE_DTR) ? 0 : TIOCM_DTR) |
-	      ((status & UART_MODE_RTS) ? 0 : TIOCM_RTS) |
-	      ((status & UART_MODE_CTS) ? 0 : TIOCM_CTS) |
-	      ((status & UART_MODE_DSR) ? 0 : TIOCM_DSR) |
-	      ((status & UART_MODE_RI) ? 0 : TIOCM_RI) |
-	      ((status & UART_MODE_CD) ? 0 : TIOCM_CD);
+	for (i = 0; i < n; i++) {
+		ret = xr_submit_read_urb(port, i, mem_flags);
+		if (ret)
+			return ret;
+	}
 
-	return ret;
+	return 0;
 }
 
-static int xr_tiocmset_port(struct usb_serial_port *port,
-			    unsigned int set, unsigned int clear)
+static enum hrtimer_restart xr_rx_pace_timer(struct hrtimer *timer)
 {
-	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	u8 gpio_set = 0;
-	u8 gpio_clr = 0;
-	int ret = 0;
-
-	/* Modem control pins are active low, so set & clr are swapped */
-	if (set & TIOCM_RTS)
-		gpio_clr |= UART_MODE_RTS;
-	if (set & TIOCM_DTR)
-		gpio_clr |= UART_MODE_DTR;
-	if (clear & TIOCM_RTS)
-		gpio_set |= UART_MODE_RTS;
-	if (clear & TIOCM_DTR)
-		gpio_set |= UART_MODE_DTR;
+	struct xr_port_private *port_priv =
+		container_of(timer, struct xr_port_private, rx_pace_timer);
+	struct usb_serial_port *port = port_priv->port;
 
-	/* Writing '0' to gpio_{set/clr} bits has no effect, so no need to do */
-	if (gpio_clr)
-		ret = xr_set_reg_uart(port,
-				      xr_hal_table[port_priv->model][REG_GPIO_CLR],
-				      gpio_clr);
+	/* Not initialized any more once the port is closing */
+	if (!tty_port_initialized(&port->port) || xr_rx_stopped(port))
+		return HRTIMER_NORESTART;
 
-	if (gpio_set)
-		ret = xr_set_reg_uart(port,
-				      xr_hal_table[port_priv->model][REG_GPIO_SET],
-				      gpio_set);
+	xr_hist_add(&port_priv->svc_hist,
+		    ktime_to_ns(ktime_sub(ktime_get(), port_priv->rx_pace_start)));
+	xr_submit_read_urbs(port, GFP_ATOMIC);
 
-	return ret;
+	return HRTIMER_NORESTART;
 }
 
-static int xr_tiocmset(struct tty_struct *tty,
-		       unsigned int set, unsigned int clear)
+/* A URB that completes while the timer runs waits for the same expiry */
+static void xr_rx_pace(struct xr_port_private *port_priv, ktime_t start,
+		       u64 ns)
 {
-	struct usb_serial_port *port = tty->driver_data;
+	if (hrtimer_is_queued(&port_priv->rx_pace_timer))
+		return;
 
-	return xr_tiocmset_port(port, set, clear);
+	port_priv->rx_pace_start = start;
+	hrtimer_start(&port_priv->rx_pace_timer, ns_to_ktime(ns),
+		      HRTIMER_MODE_REL);
 }
 
-static void xr_dtr_rts(struct usb_serial_port *port, int on)
+/* Restarts reading after a throttle, within the share of the port */
+static void xr_rx_restart(struct usb_serial_port *port, gfp_t mem_flags)
 {
-	if (on)
-		xr_tiocmset_port(port, TIOCM_DTR | TIOCM_RTS, 0);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	u64 ns = xr_rx_resubmit_ns(port_priv, 0);
+
+	if (ns)
+		xr_rx_pace(port_priv, ktime_get(), ns);
 	else
-		xr_tiocmset_port(port, 0, TIOCM_DTR | TIOCM_RTS);
+		xr_submit_read_urbs(port, mem_flags);
 }
 
-static void xr_break_ctl(struct tty_struct *tty, int break_state)
+/*
+ * Signs of a wedged channel, checked by xr_health_work(): a stalled bulk
+ * endpoint, control transfers timing out, bulk URBs failing in a row or,
+ * if recovery_silent is set, a bulk-in gone silent while the modem lines
+ * show activity.
+ */
+#define XR_HEALTH_STALLED	0
+#define XR_HEALTH_SILENT	1
+
+#define XR_HEALTH_CTRL_TIMEOUTS	3
+#define XR_HEALTH_BULK_ERRORS	32
+#define XR_HEALTH_SILENT_CHECKS	3
+#define XR_HEALTH_INTERVAL_MS	1000
+#define XR_HEALTH_WINDOW_MS	10000
+
+static void xr_health_kick(struct xr_port_private *port_priv)
 {
-	struct usb_serial_port *port = tty->driver_data;
-	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	u8 state;
+	if (port_priv->port && tty_port_initialized(&port_priv->port->port))
+		mod_delayed_work(system_long_wq, &port_priv->health_work, 0);
+}
 
-	if (port_priv->model != XR21V141X) {
-		xr_usb_serial_ctrl_msg(port, USB_CDC_REQ_SEND_BREAK, state,
-				       NULL, 0);
+static void xr_bulk_status(struct xr_port_private *port_priv, int status)
+{
+	switch (status) {
+	case 0:
+		atomic_set(&port_priv->bulk_errors, 0);
+		return;
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		/* Killed, not failed */
 		return;
+	case -EPIPE:
+		set_bit(XR_HEALTH_STALLED, &port_priv->health_flags);
+		xr_health_kick(port_priv);
+		break;
+	default:
+		if (atomic_inc_return(&port_priv->bulk_errors) >=
+		    XR_HEALTH_BULK_ERRORS)
+			xr_health_kick(port_priv);
+		break;
 	}
 
-	if (break_state == 0)
-		state = UART_BREAK_OFF;
-	else
-		state = UART_BREAK_ON;
+	atomic_inc(&xr_rate_slot(port_priv)->val[XR_RATE_ERRORS]);
+}
 
-	dev_dbg(&port->dev, "Turning break %s\n",
-		state == UART_BREAK_OFF ? "off" : "on");
-	xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_TX_BREAK],
-			state);
+static void xr_ctrl_account(struct xr_port_private *port_priv, ktime_t start,
+			    bool cdc, int ret)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (ret == -ETIMEDOUT) {
+		if (atomic_inc_return(&port_priv->ctrl_timeouts) >=
+		    XR_HEALTH_CTRL_TIMEOUTS)
+			xr_health_kick(port_priv);
+	} else if (ret >= 0) {
+		atomic_set(&port_priv->ctrl_timeouts, 0);
+	}
+
+	if (ret < 0)
+		atomic64_inc(&port_priv->cnt.ctrl_errors);
+
+	atomic64_inc(&port_priv->cnt.ctrl_xfers);
+	if (cdc)
+		atomic64_inc(&port_priv->cnt.ctrl_cdc);
+	atomic64_add(ns, &port_priv->cnt.ctrl_ns);
+	xr_hist_add(&port_priv->ctrl_hist, ns);
 }
 
-/* Tx and Rx clock mask values obtained from section 3.3.4 of datasheet */
-static const struct xr_txrx_clk_mask xr21v141x_txrx_clk_masks[] = {
-	{ 0x000, 0x000, 0x000 },
-	{ 0x000, 0x000, 0x000 },
-	{ 0x100, 0x000, 0x100 },
-	{ 0x020, 0x400, 0x020 },
-	{ 0x010, 0x100, 0x010 },
-	{ 0x208, 0x040, 0x208 },
-	{ 0x104, 0x820, 0x108 },
-	{ 0x844, 0x210, 0x884 },
-	{ 0x444, 0x110, 0x444 },
-	{ 0x122, 0x888, 0x224 },
-	{ 0x912, 0x448, 0x924 },
-	{ 0x492, 0x248, 0x492 },
-	{ 0x252, 0x928, 0x292 },
-	{ 0x94a, 0x4a4, 0xa52 },
-	{ 0x52a, 0xaa4, 0x54a },
-	{ 0xaaa, 0x954, 0x4aa },
-	{ 0xaaa, 0x554, 0xaaa },
-	{ 0x555, 0xad4, 0x5aa },
-	{ 0xb55, 0xab4, 0x55a },
-	{ 0x6b5, 0x5ac, 0xb56 },
-	{ 0x5b5, 0xd6c, 0x6d6 },
-	{ 0xb6d, 0xb6a, 0xdb6 },
-	{ 0x76d, 0x6da, 0xbb6 },
-	{ 0xedd, 0xdda, 0x76e },
-	{ 0xddd, 0xbba, 0xeee },
-	{ 0x7bb, 0xf7a, 0xdde },
-	{ 0xf7b, 0xef6, 0x7de },
-	{ 0xdf7, 0xbf6, 0xf7e },
-	{ 0x7f7, 0xfee, 0xefe },
-	{ 0xfdf, 0xfbe, 0x7fe },
-	{ 0xf7f, 0xefe, 0xffe },
-	{ 0xfff, 0xffe, 0xffd },
-};
+static void xr_cfg_lock(struct xr_port_private *port_priv)
+{
+	ktime_t start;
 
-static int xr_set_baudrate(struct tty_struct *tty,
-			   struct usb_serial_port *port)
+	if (mutex_trylock(&port_priv->cfg_lock))
+		return;
+
+	start = ktime_get();
+	mutex_lock(&port_priv->cfg_lock);
+	atomic64_inc(&port_priv->cnt.cfg_contended);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		     &port_priv->cnt.cfg_wait_ns);
+}
+
+static void xr_op_account(struct xr_port_private *port_priv,
+			  enum xr_op op, ktime_t start, bool failed)
 {
-	u32 divisor, baud, idx;
-	u16 tx_mask, rx_mask;
-	int ret;
+	struct xr_op_stats *st = &port_priv->op_stats[op];
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	unsigned long flags;
+
+	spin_lock_irqsave(&port_priv->stats_lock, flags);
+	st->count++;
+	if (failed)
+		st->errors++;
+	st->last_ns = ns;
+	st->max_ns = max(st->max_ns, ns);
+	st->total_ns += ns;
+	spin_unlock_irqrestore(&port_priv->stats_lock, flags);
+}
 
-	baud = tty->termios.c_ospeed;
-	if (!baud)
-		return 0;
+/*
+ * The vendor register and CDC class requests issued between xr_op_begin()
+ * and xr_op_end() are charged to the operation, so that the control
+ * traffic of each model can be compared with a plain CDC ACM device. An
+ * operation with a failed request counts as failed, for those that don't
+ * report their errors.
+ */
+static void xr_op_begin(struct xr_port_private *port_priv,
+			struct xr_op_mark *mark)
+{
+	mark->ctrl = atomic64_read(&port_priv->cnt.ctrl_xfers);
+	mark->ctrl_cdc = atomic64_read(&port_priv->cnt.ctrl_cdc);
+	mark->ctrl_errors = atomic64_read(&port_priv->cnt.ctrl_errors);
+	mark->start = ktime_get();
+}
 
-	baud = clamp(baud, MIN_SPEED, MAX_SPEED);
-	divisor = XR_INT_OSC_HZ / baud;
-	idx = ((32 * XR_INT_OSC_HZ) / baud) & 0x1f;
-	tx_mask = xr21v141x_txrx_clk_masks[idx].tx;
+static void xr_op_end(struct xr_port_private *port_priv, enum xr_op op,
+		      const struct xr_op_mark *mark, bool failed)
+{
+	s64 cdc = atomic64_read(&port_priv->cnt.ctrl_cdc) - mark->ctrl_cdc;
+	s64 ctrl = atomic64_read(&port_priv->cnt.ctrl_xfers) - mark->ctrl;
+	unsigned long flags;
 
-	if (divisor & 0x01)
-		rx_mask = xr21v141x_txrx_clk_masks[idx].rx1;
-	else
-		rx_mask = xr21v141x_txrx_clk_masks[idx].rx0;
+	if (atomic64_read(&port_priv->cnt.ctrl_errors) != mark->ctrl_errors)
+		failed = true;
 
-	dev_dbg(&port->dev, "Setting baud rate: %u\n", baud);
-	/*
-	 * XR21V141X uses fractional baud rate generator with 48MHz internal
-	 * oscillator and 19-bit programmable divisor. So theoretically it can
-	 * generate most commonly used baud rates with high accuracy.
-	 */
-	ret = xr_set_reg_uart(port, CLOCK_DIVISOR_0,
-			      divisor & 0xff);
-	if (ret)
-		return ret;
+	xr_op_account(port_priv, op, mark->start, failed);
 
-	ret = xr_set_reg_uart(port, CLOCK_DIVISOR_1,
-			      (divisor >>  8) & 0xff);
-	if (ret)
-		return ret;
+	spin_lock_irqsave(&port_priv->stats_lock, flags);
+	port_priv->op_stats[op].ctrl_vendor += ctrl - cdc;
+	port_priv->op_stats[op].ctrl_cdc += cdc;
+	spin_unlock_irqrestore(&port_priv->stats_lock, flags);
+}
+
+/* Killed at close or unlinked, not failed */
+static bool xr_urb_killed(int status)
+{
+	return status == -ENOENT || status == -ECONNRESET ||
+	       status == -ESHUTDOWN;
+}
+
+/*
+ * Tracks how long a bulk path takes to deliver data again after a failed
+ * URB: the first failure starts the clock, the next success stops it.
+ */
+static void xr_bulk_account(struct xr_port_private *port_priv,
+			    ktime_t *fail_start, enum xr_op op, bool failed)
+{
+	unsigned long flags;
+	ktime_t start = 0;
+
+	spin_lock_irqsave(&port_priv->stats_lock, flags);
+	if (failed) {
+		if (!*fail_start)
+			*fail_start = ktime_get();
+	} else if (*fail_start) {
+		start = *fail_start;
+		*fail_start = 0;
+	}
+	spin_unlock_irqrestore(&port_priv->stats_lock, flags);
+
+	if (start)
+		xr_op_account(port_priv, op, start, false);
+}
+
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+/*
+ * Fault injection, to measure how the driver copes with a flaky hub:
+ *
+ * - fault_ctrl_delay_us: latency added to every control transfer;
+ * - fault_stall_reg: register whose transfers STALL, as block << 16 | address;
+ * - fail_ctrl: random control transfer timeouts;
+ * - fail_rx: random loss of received bulk packets;
+ * - fault_unplugged: behave as if the device was gone.
+ */
+static int __xr_inject_ctrl_fault(struct xr_port_private *port_priv,
+				  u8 block, int reg)
+{
+	u32 delay = READ_ONCE(port_priv->fault_ctrl_delay_us);
+
+	if (delay)
+		fsleep(delay);
+
+	if (READ_ONCE(port_priv->fault_unplugged))
+		return -ENODEV;
+
+	if (reg >= 0 &&
+	    (block << 16 | reg) == READ_ONCE(port_priv->fault_stall_reg))
+		return -EPIPE;
+
+	if (should_fail(&port_priv->fail_ctrl, 1))
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+/* A reg of -1 stands for a CDC request */
+static int xr_inject_ctrl_fault(struct usb_serial_port *port, u8 block,
+				int reg)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int ret = __xr_inject_ctrl_fault(port_priv, block, reg);
 
-	ret = xr_set_reg_uart(port, CLOCK_DIVISOR_2,
-			      (divisor >> 16) & 0xff);
 	if (ret)
+		atomic64_inc(&port_priv->cnt.ctrl_errors);
+
+	return ret;
+}
+
+static bool xr_inject_rx_fault(struct usb_serial_port *port, int len)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	return READ_ONCE(port_priv->fault_unplugged) ||
+	       should_fail(&port_priv->fail_rx, len);
+}
+
+static void xr_fault_debugfs_init(struct xr_port_private *port_priv)
+{
+	struct dentry *dir = port_priv->debugfs;
+
+	port_priv->fail_ctrl = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	port_priv->fail_rx = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	port_priv->fault_stall_reg = U32_MAX;
+
+	fault_create_debugfs_attr("fail_ctrl", dir, &port_priv->fail_ctrl);
+	fault_create_debugfs_attr("fail_rx", dir, &port_priv->fail_rx);
+	debugfs_create_u32("fault_ctrl_delay_us", 0600, dir,
+			   &port_priv->fault_ctrl_delay_us);
+	debugfs_create_x32("fault_stall_reg", 0600, dir,
+			   &port_priv->fault_stall_reg);
+	debugfs_create_bool("fault_unplugged", 0600, dir,
+			    &port_priv->fault_unplugged);
+}
+#else
+static inline int xr_inject_ctrl_fault(struct usb_serial_port *port, u8 block,
+				       int reg)
+{
+	return 0;
+}
+
+static inline bool xr_inject_rx_fault(struct usb_serial_port *port, int len)
+{
+	return false;
+}
+
+static inline void xr_fault_debugfs_init(struct xr_port_private *port_priv)
+{
+}
+#endif
+
+static bool xr_has_reg(struct xr_port_private *port_priv,
+		       enum xr_hal_type type)
+{
+	return xr_hal_table[port_priv->model][type] >= 0;
+}
+
+/*
+ * Converts a register address into the wIndex of a vendor request. Most
+ * models have 8-bit addresses, with the register block on the upper byte,
+ * where XR21V141X takes the UART channel as the block of its UART
+ * registers. XR21B1411 has a flat 12-bit address space instead.
+ */
+static int xr_reg_index(struct usb_serial_port *port, u8 block, u16 reg)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	switch (port_priv->model) {
+	case XR2280X:
+		if (reg > 0xff)
+			return -EINVAL;
+		return reg | (block << 8);
+	case XR21B1411:
+		if (reg > 0xfff || block != UART_REG_BLOCK)
+			return -EINVAL;
+		return reg;
+	case XR21V141X:
+		if (reg > 0xff)
+			return -EINVAL;
+		if (block == UART_REG_BLOCK && port_priv->channel)
+			block = port_priv->channel - 1;
+		return reg | (block << 8);
+	case XR21B142X:
+		if (reg > 0xff)
+			return -EINVAL;
+		reg |= (port_priv->channel - 4) << 1;
+		return (reg & 0xff) | (block << 8);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int xr_set_reg(struct usb_serial_port *port, u8 block, u16 reg, u8 val)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct usb_serial *serial = port->serial;
+	int index, ret;
+	ktime_t start;
+
+	index = xr_reg_index(port, block, reg);
+	if (index < 0)
+		return index;
+
+	ret = xr_inject_ctrl_fault(port, block, reg);
+	if (ret) {
+		dev_err(&port->dev, "Failed to set reg 0x%03x: %d\n", reg, ret);
 		return ret;
+	}
 
-	ret = xr_set_reg_uart(port, TX_CLOCK_MASK_0,
-			      tx_mask & 0xff);
-	if (ret)
+	start = ktime_get();
+	ret = usb_control_msg(serial->dev,
+			      usb_sndctrlpipe(serial->dev, 0),
+			      xr_hal_table[port_priv->model][REQ_SET],
+			      USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			      val, index, NULL, 0,
+			      USB_CTRL_SET_TIMEOUT);
+	xr_ctrl_account(port_priv, start, false, ret);
+	if (ret < 0) {
+		dev_err(&port->dev, "Failed to set reg 0x%03x: %d\n", reg, ret);
 		return ret;
+	}
 
-	ret = xr_set_reg_uart(port, TX_CLOCK_MASK_1,
-			      (tx_mask >>  8) & 0xff);
-	if (ret)
+	return 0;
+}
+
+static int xr_get_reg(struct usb_serial_port *port, u8 block, u16 reg, u8 *val)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct usb_serial *serial = port->serial;
+	u8 *dmabuf;
+	int index, ret;
+	ktime_t start;
+
+	index = xr_reg_index(port, block, reg);
+	if (index < 0)
+		return index;
+
+	ret = xr_inject_ctrl_fault(port, block, reg);
+	if (ret) {
+		dev_err(&port->dev, "Failed to get reg 0x%03x: %d\n", reg, ret);
 		return ret;
+	}
 
-	ret = xr_set_reg_uart(port, RX_CLOCK_MASK_0,
-			      rx_mask & 0xff);
-	if (ret)
+	dmabuf = kmalloc(1, GFP_KERNEL);
+	if (!dmabuf)
+		return -ENOMEM;
+
+	start = ktime_get();
+	ret = usb_control_msg(serial->dev,
+			      usb_rcvctrlpipe(serial->dev, 0),
+			      xr_hal_table[port_priv->model][REQ_GET],
+			      USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			      0, index, dmabuf, 1,
+			      USB_CTRL_GET_TIMEOUT);
+	xr_ctrl_account(port_priv, start, false, ret);
+	if (ret == 1) {
+		*val = *dmabuf;
+		ret = 0;
+	} else {
+		dev_err(&port->dev, "Failed to get reg 0x%03x: %d\n", reg, ret);
+		if (ret >= 0)
+			ret = -EIO;
+	}
+
+	kfree(dmabuf);
+
+	return ret;
+}
+
+static int xr_usb_serial_ctrl_msg(struct usb_serial_port *port,
+				  int request, int val,
+				  void *buf, int len)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int if_num = port_priv->control_if->altsetting[0].desc.bInterfaceNumber;
+	struct usb_serial *serial = port->serial;
+	u8 *dmabuf = NULL;
+	ktime_t start;
+	int ret;
+
+	ret = xr_inject_ctrl_fault(port, 0, -1);
+	if (ret) {
+		dev_err(&port->dev, "Failed to send a control msg: %d\n", ret);
 		return ret;
+	}
+
+	if (len) {
+		dmabuf = kmemdup(buf, len, GFP_KERNEL);
+		if (!dmabuf)
+			return -ENOMEM;
+	}
+
+	start = ktime_get();
+	ret = usb_control_msg(serial->dev,
+			      usb_rcvctrlpipe(serial->dev, 0),
+			      request,
+			      USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+			      val,
+			      if_num, dmabuf, len,
+			      USB_CTRL_GET_TIMEOUT);
+	xr_ctrl_account(port_priv, start, true, ret);
+
+	if (ret < 0) {
+		dev_err(&port->dev, "Failed to send a control msg: %d\n", ret);
+	} else {
+		if (dmabuf)
+			memcpy(buf, dmabuf, len);
+		ret = 0;
+	}
+
+	kfree(dmabuf);
+
+	return ret;
+}
+
+static int xr_set_reg_uart(struct usb_serial_port *port, u16 reg, u8 val)
+{
+	return xr_set_reg(port, UART_REG_BLOCK, reg, val);
+}
+
+static int xr_get_reg_uart(struct usb_serial_port *port, u16 reg, u8 *val)
+{
+	return xr_get_reg(port, UART_REG_BLOCK, reg, val);
+}
+
+static int xr_set_reg_um(struct usb_serial_port *port, u16 reg, u8 val)
+{
+	return xr_set_reg(port, UM_REG_BLOCK, reg, val);
+}
+
+/*
+ * According to datasheet, below is the recommended sequence for enabling UART
+ * module in XR21V141X:
+ *
+ * Enable Tx FIFO
+ * Enable Tx and Rx
+ * Enable Rx FIFO
+ */
+static int xr_uart_enable(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int ret;
+
+	if (port_priv->model != XR21V141X)
+		return xr_set_reg_uart(port,
+				       xr_hal_table[port_priv->model][REG_ENABLE],
+				       UART_ENABLE_TX | UART_ENABLE_RX);
+
+	ret = xr_set_reg_um(port, UM_FIFO_ENABLE_REG,
+			    UM_ENABLE_TX_FIFO);
+	if (ret)
+		return ret;
+
+	ret = xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_ENABLE],
+			      UART_ENABLE_TX | UART_ENABLE_RX);
+	if (ret)
+		return ret;
+
+	ret = xr_set_reg_um(port, UM_FIFO_ENABLE_REG,
+			    UM_ENABLE_TX_FIFO | UM_ENABLE_RX_FIFO);
+
+	if (ret)
+		xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_ENABLE], 0);
+
+	return ret;
+}
+
+static int xr_uart_disable(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int ret;
+
+	ret = xr_set_reg_uart(port,
+			      xr_hal_table[port_priv->model][REG_ENABLE], 0);
+	if (ret)
+		return ret;
+
+	if (port_priv->model != XR21V141X)
+		return 0;
+
+	ret = xr_set_reg_um(port, UM_FIFO_ENABLE_REG, 0);
+
+	return ret;
+}
+
+static int fifo_reset(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int channel = port_priv->channel;
+	int ret = 0;
+
+	if (port_priv->model != XR21V141X)
+		return 0;
+
+	if (channel)
+		channel--;
+
+	ret = xr_set_reg_um(port,
+			    URM_RESET_RX_FIFO_BASE + channel, 0xff);
+	if (ret)
+		return ret;
+
+	ret = xr_set_reg_um(port,
+			    URM_RESET_TX_FIFO_BASE + channel, 0xff);
+
+	return ret;
+}
+
+static int xr_status_to_tiocm(u8 status)
+{
+	/*
+	 * Modem control pins are active low, so reading '0' means it is active
+	 * and '1' means not active.
+	 */
+	return ((status & UART_MODE_DTR) ? 0 : TIOCM_DTR) |
+	       ((status & UART_MODE_RTS) ? 0 : TIOCM_RTS) |
+	       ((status & UART_MODE_CTS) ? 0 : TIOCM_CTS) |
+	       ((status & UART_MODE_DSR) ? 0 : TIOCM_DSR) |
+	       ((status & UART_MODE_RI) ? 0 : TIOCM_RI) |
+	       ((status & UART_MODE_CD) ? 0 : TIOCM_CD);
+}
+
+static bool xr_msr_poll_wanted(struct xr_port_private *port_priv)
+{
+	return port_priv->msr_waiters || port_priv->msr_watch_cd;
+}
+
+/*
+ * None of the supported models get their GPIO change notifications handled,
+ * so modem status changes are detected by polling REG_GPIO_STATUS, but only
+ * while someone waits on TIOCMIWAIT or needs carrier detect. The interval
+ * drops to the minimum on every change and doubles while the lines are
+ * stable.
+ */
+static void xr_msr_work(struct work_struct *work)
+{
+	struct xr_port_private *port_priv =
+		container_of(to_delayed_work(work), struct xr_port_private,
+			     msr_work);
+	struct usb_serial_port *port = port_priv->port;
+	struct tty_struct *tty;
+	u8 status, changed = 0;
+	bool rearm;
+	int ret;
+
+	ret = xr_get_reg_uart(port,
+			      xr_hal_table[port_priv->model][REG_GPIO_STATUS],
+			      &status);
+
+	spin_lock_irq(&port_priv->msr_lock);
+	if (!ret) {
+		if (port_priv->msr_valid)
+			changed = (port_priv->msr ^ status) &
+				  (UART_MODE_CTS | UART_MODE_DSR |
+				   UART_MODE_RI | UART_MODE_CD);
+		port_priv->msr = status;
+		port_priv->msr_valid = true;
+	}
+
+	if (changed)
+		port_priv->msr_interval = XR_MSR_POLL_MIN_MS;
+	else
+		port_priv->msr_interval = min_t(unsigned int,
+						port_priv->msr_interval * 2,
+						XR_MSR_POLL_MAX_MS);
+
+	rearm = xr_msr_poll_wanted(port_priv);
+	spin_unlock_irq(&port_priv->msr_lock);
+
+	if (changed) {
+		spin_lock_irq(&port->lock);
+		if (changed & UART_MODE_CTS)
+			port->icount.cts++;
+		if (changed & UART_MODE_DSR)
+			port->icount.dsr++;
+		if (changed & UART_MODE_RI)
+			port->icount.rng++;
+		if (changed & UART_MODE_CD)
+			port->icount.dcd++;
+		spin_unlock_irq(&port->lock);
+
+		if (changed & UART_MODE_CD) {
+			tty = tty_port_tty_get(&port->port);
+			usb_serial_handle_dcd_change(port, tty,
+						     !(status & UART_MODE_CD));
+			tty_kref_put(tty);
+		}
+
+		wake_up_interruptible(&port->port.delta_msr_wait);
+	}
+
+	if (rearm)
+		schedule_delayed_work(&port_priv->msr_work,
+				      msecs_to_jiffies(port_priv->msr_interval));
+}
+
+/* Must be called with msr_lock held */
+static void xr_msr_poll_kick(struct xr_port_private *port_priv, bool was_idle)
+{
+	/* A stale cache would report old transitions as new ones */
+	if (was_idle)
+		port_priv->msr_valid = false;
+
+	port_priv->msr_interval = XR_MSR_POLL_MIN_MS;
+	mod_delayed_work(system_wq, &port_priv->msr_work, 0);
+}
+
+static void xr_msr_watch_cd(struct usb_serial_port *port, bool watch)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	bool was_idle;
+
+	spin_lock_irq(&port_priv->msr_lock);
+	was_idle = !xr_msr_poll_wanted(port_priv);
+	port_priv->msr_watch_cd = watch;
+	if (watch && was_idle)
+		xr_msr_poll_kick(port_priv, true);
+	spin_unlock_irq(&port_priv->msr_lock);
+}
+
+static int xr_tiocmiwait(struct tty_struct *tty, unsigned long arg)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int ret;
+
+	spin_lock_irq(&port_priv->msr_lock);
+	xr_msr_poll_kick(port_priv, !xr_msr_poll_wanted(port_priv));
+	port_priv->msr_waiters++;
+	spin_unlock_irq(&port_priv->msr_lock);
+
+	ret = usb_serial_generic_tiocmiwait(tty, arg);
+
+	spin_lock_irq(&port_priv->msr_lock);
+	port_priv->msr_waiters--;
+	spin_unlock_irq(&port_priv->msr_lock);
+
+	return ret;
+}
+
+static int xr_tiocmget(struct tty_struct *tty)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	bool cached;
+	u8 status;
+	int ret;
+
+	/* While the poller runs, its cache is at most one interval old */
+	spin_lock_irq(&port_priv->msr_lock);
+	cached = xr_msr_poll_wanted(port_priv) && port_priv->msr_valid;
+	status = port_priv->msr;
+	spin_unlock_irq(&port_priv->msr_lock);
+
+	if (cached)
+		return xr_status_to_tiocm(status);
+
+	ret = xr_get_reg_uart(port,
+			      xr_hal_table[port_priv->model][REG_GPIO_STATUS],
+			      &status);
+	if (ret)
+		return ret;
+
+	return xr_status_to_tiocm(status);
+}
+
+/* Keeps the DTR/RTS bits of the poller cache in line with what was written */
+static void xr_msr_outputs(struct xr_port_private *port_priv,
+			   u8 gpio_set, u8 gpio_clr)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&port_priv->msr_lock, flags);
+	port_priv->msr = (port_priv->msr & ~gpio_clr) | gpio_set;
+	spin_unlock_irqrestore(&port_priv->msr_lock, flags);
+}
+
+static int xr_tiocmset_port(struct usb_serial_port *port,
+			    unsigned int set, unsigned int clear)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	u8 gpio_set = 0;
+	u8 gpio_clr = 0;
+	int ret = 0;
+
+	/* Modem control pins are active low, so set & clr are swapped */
+	if (set & TIOCM_RTS)
+		gpio_clr |= UART_MODE_RTS;
+	if (set & TIOCM_DTR)
+		gpio_clr |= UART_MODE_DTR;
+	if (clear & TIOCM_RTS)
+		gpio_set |= UART_MODE_RTS;
+	if (clear & TIOCM_DTR)
+		gpio_set |= UART_MODE_DTR;
+
+	/* Writing '0' to gpio_{set/clr} bits has no effect, so no need to do */
+	if (gpio_clr) {
+		ret = xr_set_reg_uart(port,
+				      xr_hal_table[port_priv->model][REG_GPIO_CLR],
+				      gpio_clr);
+		if (!ret)
+			xr_msr_outputs(port_priv, 0, gpio_clr);
+	}
+
+	if (gpio_set) {
+		ret = xr_set_reg_uart(port,
+				      xr_hal_table[port_priv->model][REG_GPIO_SET],
+				      gpio_set);
+		if (!ret)
+			xr_msr_outputs(port_priv, gpio_set, 0);
+	}
+
+	/* Kept for replaying the configuration after a recovery */
+	if (!ret)
+		WRITE_ONCE(port_priv->mctrl,
+			   (port_priv->mctrl & ~clear) | set);
+
+	return ret;
+}
+
+/*
+ * While the hardware setup is deferred, modem control changes are only
+ * recorded, to be applied together with the rest of the configuration.
+ */
+static bool xr_defer_mctrl(struct usb_serial_port *port,
+			   unsigned int set, unsigned int clear)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	bool pending;
+
+	xr_cfg_lock(port_priv);
+	pending = port_priv->cfg_pending;
+	if (pending) {
+		port_priv->cfg_mctrl_set = (port_priv->cfg_mctrl_set & ~clear) | set;
+		port_priv->cfg_mctrl_clear = (port_priv->cfg_mctrl_clear & ~set) | clear;
+	}
+	mutex_unlock(&port_priv->cfg_lock);
+
+	return pending;
+}
+
+static int xr_tiocmset(struct tty_struct *tty,
+		       unsigned int set, unsigned int clear)
+{
+	struct usb_serial_port *port = tty->driver_data;
+
+	if (xr_defer_mctrl(port, set, clear))
+		return 0;
+
+	return xr_tiocmset_port(port, set, clear);
+}
+
+static void xr_dtr_rts(struct usb_serial_port *port, int on)
+{
+	unsigned int set = 0, clear = 0;
+
+	if (on)
+		set = TIOCM_DTR | TIOCM_RTS;
+	else
+		clear = TIOCM_DTR | TIOCM_RTS;
+
+	if (xr_defer_mctrl(port, set, clear))
+		return;
+
+	xr_tiocmset_port(port, set, clear);
+}
+
+/*
+ * Timed URB sequences
+ *
+ * Some line protocols need a precise gap between two actions, like the
+ * break and the first byte of a DMX512 or LIN frame. Doing it with
+ * synchronous control messages adds the scheduling latency of every step
+ * to the gap. Instead, all URBs are built beforehand and each one is
+ * submitted either from the completion handler of the previous step or
+ * from a hrtimer, so the gaps depend only on the USB bus.
+ */
+struct xr_seq_step {
+	struct urb *urb;
+	void *buf;
+	u64 delay_ns;
+	ktime_t done;
+};
+
+struct xr_seq {
+	struct usb_serial_port *port;
+	struct hrtimer timer;
+	struct completion done;
+	bool cancelled;
+	unsigned int count;
+	unsigned int next;
+	int status;
+	struct xr_seq_step steps[];
+};
+
+static void xr_seq_submit_next(struct xr_seq *seq)
+{
+	struct xr_seq_step *step = &seq->steps[seq->next];
+	int ret;
+
+	ret = usb_submit_urb(step->urb, GFP_ATOMIC);
+	if (ret) {
+		seq->status = ret;
+		complete(&seq->done);
+	}
+}
+
+static enum hrtimer_restart xr_seq_timer(struct hrtimer *timer)
+{
+	struct xr_seq *seq = container_of(timer, struct xr_seq, timer);
+
+	if (!READ_ONCE(seq->cancelled))
+		xr_seq_submit_next(seq);
+
+	return HRTIMER_NORESTART;
+}
+
+static void xr_seq_callback(struct urb *urb)
+{
+	struct xr_seq *seq = urb->context;
+	struct xr_seq_step *step = &seq->steps[seq->next];
+
+	step->done = ktime_get();
+
+	if (urb->status) {
+		seq->status = urb->status;
+		complete(&seq->done);
+		return;
+	}
+
+	if (++seq->next == seq->count) {
+		complete(&seq->done);
+		return;
+	}
+
+	if (READ_ONCE(seq->cancelled))
+		return;
+
+	if (step->delay_ns)
+		hrtimer_start(&seq->timer, ns_to_ktime(step->delay_ns),
+			      HRTIMER_MODE_REL);
+	else
+		xr_seq_submit_next(seq);
+}
+
+static struct xr_seq *xr_seq_alloc(struct usb_serial_port *port,
+				   unsigned int count)
+{
+	struct xr_seq *seq;
+
+	seq = kzalloc(struct_size(seq, steps, count), GFP_KERNEL);
+	if (!seq)
+		return NULL;
+
+	seq->port = port;
+	init_completion(&seq->done);
+	hrtimer_init(&seq->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	seq->timer.function = xr_seq_timer;
+
+	return seq;
+}
+
+static void xr_seq_free(struct xr_seq *seq)
+{
+	unsigned int i;
+
+	/*
+	 * A completion handler may still arm the timer until it sees the
+	 * cancelled flag, so the timer is stopped again once all URBs are
+	 * known to be idle.
+	 */
+	WRITE_ONCE(seq->cancelled, true);
+	smp_mb();
+	hrtimer_cancel(&seq->timer);
+	for (i = 0; i < seq->count; i++)
+		usb_kill_urb(seq->steps[i].urb);
+	hrtimer_cancel(&seq->timer);
+	for (i = 0; i < seq->count; i++)
+		usb_kill_urb(seq->steps[i].urb);
+
+	for (i = 0; i < seq->count; i++) {
+		xr_free_urb(seq->steps[i].urb);
+		kfree(seq->steps[i].buf);
+	}
+
+	kfree(seq);
+}
+
+static int xr_seq_add_ctrl(struct xr_seq *seq, u8 request_type, u8 request,
+			   u16 value, u16 index, u64 delay_ns)
+{
+	struct usb_device *udev = seq->port->serial->dev;
+	struct xr_seq_step *step = &seq->steps[seq->count];
+	struct usb_ctrlrequest *dr;
+
+	step->urb = xr_alloc_urb(GFP_KERNEL);
+	if (!step->urb)
+		return -ENOMEM;
+
+	dr = kmalloc(sizeof(*dr), GFP_KERNEL);
+	if (!dr) {
+		xr_free_urb(step->urb);
+		step->urb = NULL;
+		return -ENOMEM;
+	}
+
+	dr->bRequestType = request_type;
+	dr->bRequest = request;
+	dr->wValue = cpu_to_le16(value);
+	dr->wIndex = cpu_to_le16(index);
+	dr->wLength = 0;
+
+	usb_fill_control_urb(step->urb, udev, usb_sndctrlpipe(udev, 0),
+			     (unsigned char *)dr, NULL, 0,
+			     xr_seq_callback, seq);
+	step->buf = dr;
+	step->delay_ns = delay_ns;
+	seq->count++;
+
+	return 0;
+}
+
+static int xr_seq_add_set_reg(struct xr_seq *seq, u8 block, u16 reg, u8 val,
+			      u64 delay_ns)
+{
+	struct usb_serial_port *port = seq->port;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int index;
+
+	index = xr_reg_index(port, block, reg);
+	if (index < 0)
+		return index;
+
+	return xr_seq_add_ctrl(seq,
+			       USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			       xr_hal_table[port_priv->model][REQ_SET],
+			       val, index, delay_ns);
+}
+
+static int xr_seq_add_cdc(struct xr_seq *seq, u8 request, u16 value,
+			  u64 delay_ns)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(seq->port->serial);
+	int if_num = port_priv->control_if->altsetting[0].desc.bInterfaceNumber;
+
+	return xr_seq_add_ctrl(seq,
+			       USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+			       request, value, if_num, delay_ns);
+}
+
+/* Takes ownership of buf */
+static int xr_seq_add_bulk(struct xr_seq *seq, void *buf, size_t len,
+			   u64 delay_ns)
+{
+	struct usb_serial_port *port = seq->port;
+	struct usb_device *udev = port->serial->dev;
+	struct xr_seq_step *step = &seq->steps[seq->count];
+
+	step->urb = xr_alloc_urb(GFP_KERNEL);
+	if (!step->urb) {
+		kfree(buf);
+		return -ENOMEM;
+	}
+
+	usb_fill_bulk_urb(step->urb, udev,
+			  usb_sndbulkpipe(udev, port->bulk_out_endpointAddress),
+			  buf, len, xr_seq_callback, seq);
+	step->buf = buf;
+	step->delay_ns = delay_ns;
+	seq->count++;
+
+	return 0;
+}
+
+static int xr_seq_run(struct xr_seq *seq)
+{
+	unsigned long timeout = msecs_to_jiffies(USB_CTRL_SET_TIMEOUT);
+	unsigned int i;
+
+	if (!seq->count)
+		return 0;
+
+	for (i = 0; i < seq->count; i++)
+		timeout += nsecs_to_jiffies(seq->steps[i].delay_ns);
+
+	seq->next = 0;
+	seq->status = 0;
+	xr_seq_submit_next(seq);
+
+	if (!wait_for_completion_timeout(&seq->done, timeout))
+		return -ETIMEDOUT;
+
+	return seq->status;
+}
+
+/*
+ * Takes the transmitter of an idle port, so that tty writes wait until the
+ * ioctl is done rather than go out in between.
+ */
+static int xr_tx_claim(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (kfifo_len(&port->write_fifo) || port->tx_bytes ||
+	    port_priv->tx_claimed)
+		ret = -EBUSY;
+	else
+		port_priv->tx_claimed = true;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	return ret;
+}
+
+static void xr_tx_release(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->lock, flags);
+	port_priv->tx_claimed = false;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	tty_port_tty_wakeup(&port->port);
+}
+
+static int xr_timed_break(struct tty_struct *tty,
+			  struct xr_timed_break __user *argp)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	u64 bit_ns, break_ns, mab_ns;
+	struct xr_timed_break brk;
+	unsigned int baud, hdr = 0;
+	struct xr_seq *seq;
+	u8 *frame = NULL;
+	int ret;
+
+	if (copy_from_user(&brk, argp, sizeof(brk)))
+		return -EFAULT;
+
+	if (brk.len > XR_BREAK_MAX_FRAME || brk.reserved ||
+	    brk.break_us > USEC_PER_SEC || brk.mab_us > USEC_PER_SEC)
+		return -EINVAL;
+
+	baud = tty_get_baud_rate(tty);
+	if (!baud)
+		return -EINVAL;
+
+	bit_ns = NSEC_PER_SEC / baud;
+	break_ns = (u64)brk.break_us * NSEC_PER_USEC;
+	mab_ns = (u64)brk.mab_us * NSEC_PER_USEC;
+
+	switch (brk.mode) {
+	case XR_BREAK_RAW:
+		if (!break_ns)
+			return -EINVAL;
+		break;
+	case XR_BREAK_LIN:
+		/* Break of at least 13 bits, followed by a 1 bit delimiter */
+		if (!break_ns)
+			break_ns = 13 * bit_ns;
+		if (!mab_ns)
+			mab_ns = bit_ns;
+		hdr = 1;
+		break;
+	case XR_BREAK_DMX:
+		/* ANSI E1.11 typical transmitter timing */
+		if (brk.start_code > 0xff)
+			return -EINVAL;
+		if (!break_ns)
+			break_ns = 176 * NSEC_PER_USEC;
+		if (!mab_ns)
+			mab_ns = 12 * NSEC_PER_USEC;
+		hdr = 1;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (hdr + brk.len) {
+		frame = kmalloc(hdr + brk.len, GFP_KERNEL);
+		if (!frame)
+			return -ENOMEM;
+
+		if (brk.mode == XR_BREAK_LIN)
+			frame[0] = 0x55;
+		else if (brk.mode == XR_BREAK_DMX)
+			frame[0] = brk.start_code;
+
+		if (copy_from_user(frame + hdr, u64_to_user_ptr(brk.frame),
+				   brk.len)) {
+			kfree(frame);
+			return -EFAULT;
+		}
+	}
+
+	/* The frame must not be interleaved with regular writes */
+	ret = xr_tx_claim(port);
+	if (ret) {
+		kfree(frame);
+		return ret;
+	}
+
+	seq = xr_seq_alloc(port, 3);
+	if (!seq) {
+		kfree(frame);
+		ret = -ENOMEM;
+		goto out_release;
+	}
+
+	if (port_priv->model != XR21V141X) {
+		/*
+		 * The device times a CDC break by itself, in ms units, and
+		 * completes the request as soon as the break starts.
+		 */
+		u64 break_ms = DIV_ROUND_UP_ULL(break_ns, NSEC_PER_MSEC);
+
+		ret = xr_seq_add_cdc(seq, USB_CDC_REQ_SEND_BREAK, break_ms,
+				     break_ms * NSEC_PER_MSEC + mab_ns);
+	} else {
+		u16 reg = xr_hal_table[port_priv->model][REG_TX_BREAK];
+
+		ret = xr_seq_add_set_reg(seq, UART_REG_BLOCK, reg,
+					 UART_BREAK_ON, break_ns);
+		if (!ret)
+			ret = xr_seq_add_set_reg(seq, UART_REG_BLOCK, reg,
+						 UART_BREAK_OFF, mab_ns);
+	}
+
+	if (!ret && frame)
+		ret = xr_seq_add_bulk(seq, frame, hdr + brk.len, 0);
+	else
+		kfree(frame);
+
+	if (!ret)
+		ret = xr_seq_run(seq);
+
+	if (ret)
+		dev_dbg(&port->dev, "Timed break failed: %d\n", ret);
+
+	xr_seq_free(seq);
+out_release:
+	xr_tx_release(port);
+
+	return ret;
+}
+
+/* Records the DTR/RTS state a sequence left, from the active low GPIO bits */
+static void xr_mctrl_seq_shadow(struct xr_port_private *port_priv, u8 gpio)
+{
+	u8 lines = UART_MODE_DTR | UART_MODE_RTS;
+	unsigned int mctrl = 0;
+
+	if (!(gpio & UART_MODE_DTR))
+		mctrl |= TIOCM_DTR;
+	if (!(gpio & UART_MODE_RTS))
+		mctrl |= TIOCM_RTS;
+
+	WRITE_ONCE(port_priv->mctrl,
+		   (port_priv->mctrl & ~(TIOCM_DTR | TIOCM_RTS)) | mctrl);
+	xr_msr_outputs(port_priv, gpio & lines, ~gpio & lines);
+}
+
+/*
+ * Each step only writes the lines that change, with the step delay after
+ * its last URB; a step that changes nothing extends the previous hold.
+ */
+static int xr_mctrl_seq(struct usb_serial_port *port,
+			struct xr_mctrl_seq __user *argp)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	u16 set_reg = xr_hal_table[port_priv->model][REG_GPIO_SET];
+	u16 clr_reg = xr_hal_table[port_priv->model][REG_GPIO_CLR];
+	unsigned int last[XR_MCTRL_MAX_STEPS];
+	u8 lines = UART_MODE_DTR | UART_MODE_RTS;
+	struct xr_mctrl_seq *req;
+	u64 requested = 0;
+	struct xr_seq *seq;
+	unsigned int i;
+	u8 prev = 0;
+	ktime_t base;
+	s64 dev;
+	int ret;
+
+	req = memdup_user(argp, sizeof(*req));
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	if (!req->count || req->count > XR_MCTRL_MAX_STEPS || req->reserved) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < req->count; i++) {
+		if (req->steps[i].mctrl & ~(TIOCM_DTR | TIOCM_RTS) ||
+		    req->steps[i].delay_us > USEC_PER_SEC) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	seq = xr_seq_alloc(port, 2 * req->count);
+	if (!seq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0, ret = 0; i < req->count; i++) {
+		u32 mctrl = req->steps[i].mctrl;
+		u8 want = 0, clr, set;
+
+		if (mctrl & TIOCM_DTR)
+			want |= UART_MODE_DTR;
+		if (mctrl & TIOCM_RTS)
+			want |= UART_MODE_RTS;
+
+		/* The first step writes both lines, whatever their state */
+		if (!i) {
+			clr = want;
+			set = lines & ~want;
+		} else {
+			clr = want & ~prev;
+			set = prev & ~want;
+		}
+		prev = want;
+
+		/* Modem control pins are active low */
+		if (clr)
+			ret = xr_seq_add_set_reg(seq, UART_REG_BLOCK, clr_reg,
+						 clr, 0);
+		if (!ret && set)
+			ret = xr_seq_add_set_reg(seq, UART_REG_BLOCK, set_reg,
+						 set, 0);
+		if (ret)
+			break;
+
+		seq->steps[seq->count - 1].delay_ns +=
+			(u64)req->steps[i].delay_us * NSEC_PER_USEC;
+		last[i] = clr || set ? seq->count - 1 : UINT_MAX;
+	}
+
+	if (!ret) {
+		ret = xr_seq_run(seq);
+		if (!ret)
+			xr_mctrl_seq_shadow(port_priv, lines & ~prev);
+	}
+
+	if (ret) {
+		dev_dbg(&port->dev, "Modem control sequence failed: %d\n", ret);
+		xr_seq_free(seq);
+
+		/* Some steps may have run, take the state from the chip */
+		if (!xr_get_reg_uart(port,
+				     xr_hal_table[port_priv->model][REG_GPIO_STATUS],
+				     &prev))
+			xr_mctrl_seq_shadow(port_priv, prev);
+		goto out;
+	}
+
+	base = seq->steps[last[0]].done;
+	req->max_deviation_ns = 0;
+	for (i = 0; i < req->count; i++) {
+		/* A step without changes takes effect as requested */
+		if (last[i] == UINT_MAX)
+			req->steps[i].actual_ns = requested;
+		else
+			req->steps[i].actual_ns =
+				ktime_to_ns(ktime_sub(seq->steps[last[i]].done,
+						      base));
+
+		dev = req->steps[i].actual_ns - requested;
+		req->max_deviation_ns = max_t(s64, req->max_deviation_ns,
+					      abs(dev));
+		requested += (u64)req->steps[i].delay_us * NSEC_PER_USEC;
+	}
+
+	xr_seq_free(seq);
+
+	if (copy_to_user(argp, req, sizeof(*req)))
+		ret = -EFAULT;
+
+out:
+	kfree(req);
+
+	return ret;
+}
+
+/* Tx and Rx clock mask values obtained from section 3.3.4 of datasheet */
+static const struct xr_txrx_clk_mask xr21v141x_txrx_clk_masks[] = {
+	{ 0x000, 0x000, 0x000 },
+	{ 0x000, 0x000, 0x000 },
+	{ 0x100, 0x000, 0x100 },
+	{ 0x020, 0x400, 0x020 },
+	{ 0x010, 0x100, 0x010 },
+	{ 0x208, 0x040, 0x208 },
+	{ 0x104, 0x820, 0x108 },
+	{ 0x844, 0x210, 0x884 },
+	{ 0x444, 0x110, 0x444 },
+	{ 0x122, 0x888, 0x224 },
+	{ 0x912, 0x448, 0x924 },
+	{ 0x492, 0x248, 0x492 },
+	{ 0x252, 0x928, 0x292 },
+	{ 0x94a, 0x4a4, 0xa52 },
+	{ 0x52a, 0xaa4, 0x54a },
+	{ 0xaaa, 0x954, 0x4aa },
+	{ 0xaaa, 0x554, 0xaaa },
+	{ 0x555, 0xad4, 0x5aa },
+	{ 0xb55, 0xab4, 0x55a },
+	{ 0x6b5, 0x5ac, 0xb56 },
+	{ 0x5b5, 0xd6c, 0x6d6 },
+	{ 0xb6d, 0xb6a, 0xdb6 },
+	{ 0x76d, 0x6da, 0xbb6 },
+	{ 0xedd, 0xdda, 0x76e },
+	{ 0xddd, 0xbba, 0xeee },
+	{ 0x7bb, 0xf7a, 0xdde },
+	{ 0xf7b, 0xef6, 0x7de },
+	{ 0xdf7, 0xbf6, 0xf7e },
+	{ 0x7f7, 0xfee, 0xefe },
+	{ 0xfdf, 0xfbe, 0x7fe },
+	{ 0xf7f, 0xefe, 0xffe },
+	{ 0xfff, 0xffe, 0xffd },
+};
+
+/* Baud rate generator settings of the models with a private register */
+struct xr_baud_regs {
+	u32 divisor;
+	u16 tx_mask;
+	u16 rx_mask;
+};
+
+/* Returns the rate actually used */
+static u32 xr_calc_baudrate(u32 baud, struct xr_baud_regs *regs)
+{
+	u32 idx;
+
+	baud = clamp(baud, MIN_SPEED, MAX_SPEED);
+	regs->divisor = XR_INT_OSC_HZ / baud;
+	idx = ((32 * XR_INT_OSC_HZ) / baud) & 0x1f;
+	regs->tx_mask = xr21v141x_txrx_clk_masks[idx].tx;
+
+	if (regs->divisor & 0x01)
+		regs->rx_mask = xr21v141x_txrx_clk_masks[idx].rx1;
+	else
+		regs->rx_mask = xr21v141x_txrx_clk_masks[idx].rx0;
+
+	return baud;
+}
+
+static int xr_write_baudrate(struct usb_serial_port *port,
+			     const struct xr_baud_regs *regs)
+{
+	u32 divisor = regs->divisor;
+	u16 tx_mask = regs->tx_mask;
+	u16 rx_mask = regs->rx_mask;
+	int ret;
+
+	/*
+	 * XR21V141X uses fractional baud rate generator with 48MHz internal
+	 * oscillator and 19-bit programmable divisor. So theoretically it can
+	 * generate most commonly used baud rates with high accuracy.
+	 */
+	ret = xr_set_reg_uart(port, CLOCK_DIVISOR_0,
+			      divisor & 0xff);
+	if (ret)
+		return ret;
+
+	ret = xr_set_reg_uart(port, CLOCK_DIVISOR_1,
+			      (divisor >>  8) & 0xff);
+	if (ret)
+		return ret;
+
+	ret = xr_set_reg_uart(port, CLOCK_DIVISOR_2,
+			      (divisor >> 16) & 0xff);
+	if (ret)
+		return ret;
+
+	ret = xr_set_reg_uart(port, TX_CLOCK_MASK_0,
+			      tx_mask & 0xff);
+	if (ret)
+		return ret;
+
+	ret = xr_set_reg_uart(port, TX_CLOCK_MASK_1,
+			      (tx_mask >>  8) & 0xff);
+	if (ret)
+		return ret;
+
+	ret = xr_set_reg_uart(port, RX_CLOCK_MASK_0,
+			      rx_mask & 0xff);
+	if (ret)
+		return ret;
+
+	return xr_set_reg_uart(port, RX_CLOCK_MASK_1,
+			       (rx_mask >>  8) & 0xff);
+}
+
+static int xr_set_baudrate(struct tty_struct *tty,
+			   struct usb_serial_port *port)
+{
+	struct xr_baud_regs regs;
+	u32 baud;
+	int ret;
+
+	baud = tty->termios.c_ospeed;
+	if (!baud)
+		return 0;
+
+	baud = xr_calc_baudrate(baud, &regs);
+
+	dev_dbg(&port->dev, "Setting baud rate: %u\n", baud);
+
+	ret = xr_write_baudrate(port, &regs);
+	if (ret)
+		return ret;
+
+	tty_encode_baud_rate(tty, baud, baud);
+
+	return 0;
+}
+
+static void xr_set_flow_mode(struct tty_struct *tty,
+			     struct usb_serial_port *port,
+			     struct ktermios *old_termios)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	u8 flow, gpio_mode;
+	int ret;
+
+	ret = xr_get_reg_uart(port, xr_hal_table[port_priv->model][REG_GPIO_MODE], &gpio_mode);
+	if (ret)
+		return;
+
+	/* Set GPIO mode for controlling the pins manually by default. */
+	gpio_mode &= ~UART_MODE_GPIO_MASK;
+
+	if (C_CRTSCTS(tty) && C_BAUD(tty) != B0) {
+		dev_dbg(&port->dev, "Enabling hardware flow ctrl\n");
+		gpio_mode |= UART_MODE_RTS_CTS;
+		flow = UART_FLOW_MODE_HW;
+	} else if (I_IXON(tty)) {
+		u8 start_char = START_CHAR(tty);
+		u8 stop_char = STOP_CHAR(tty);
+
+		dev_dbg(&port->dev, "Enabling sw flow ctrl\n");
+		flow = UART_FLOW_MODE_SW;
+
+		xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_XON_CHAR], start_char);
+		xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_XOFF_CHAR], stop_char);
+	} else {
+		dev_dbg(&port->dev, "Disabling flow ctrl\n");
+		flow = UART_FLOW_MODE_NONE;
+	}
+
+	/* In RS-485 mode, RTS is driven by the UART as transmitter enable */
+	if (port_priv->rs485) {
+		dev_dbg(&port->dev, "Enabling RS-485 mode\n");
+		gpio_mode &= ~UART_MODE_GPIO_MASK;
+		gpio_mode |= UART_MODE_RS485;
+		if (flow == UART_FLOW_MODE_HW)
+			flow = UART_FLOW_MODE_NONE;
+
+		xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_RS485_DELAY],
+				port_priv->rs485_delay);
+	}
+
+	/*
+	 * Add support for the TXT and RXT function for 0x1420, 0x1422, 0x1424,
+	 * by setting GPIO_MODE [9:8] = '11'
+	 */
+	if (port_priv->model == XR21B142X)
+		gpio_mode |= 0x300;
+
+	/*
+	 * As per the datasheet, UART needs to be disabled while writing to
+	 * FLOW_CONTROL register.
+	 */
+	xr_uart_disable(port);
+	xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_FLOW_CTRL], flow);
+	xr_uart_enable(port);
+
+	xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_GPIO_MODE], gpio_mode);
+
+	if (C_BAUD(tty) == B0)
+		xr_tiocmset_port(port, 0, TIOCM_DTR | TIOCM_RTS);
+	else if (old_termios && (old_termios->c_cflag & CBAUD) == B0)
+		xr_tiocmset_port(port, TIOCM_DTR | TIOCM_RTS, 0);
+}
+
+static void xr_cdc_line_coding(struct tty_struct *tty,
+			       struct usb_cdc_line_coding *line)
+{
+	struct ktermios *termios = &tty->termios;
+
+	memset(line, 0, sizeof(*line));
+
+	line->dwDTERate = cpu_to_le32(tty_get_baud_rate(tty));
+	line->bCharFormat = termios->c_cflag & CSTOPB ? 1 : 0;
+	line->bParityType = termios->c_cflag & PARENB ?
+			    (termios->c_cflag & PARODD ? 1 : 2) +
+			    (termios->c_cflag & CMSPAR ? 2 : 0) : 0;
+
+	switch (C_CSIZE(tty)) {
+	case CS5:
+		line->bDataBits = 5;
+		break;
+	case CS6:
+		line->bDataBits = 6;
+		break;
+	case CS7:
+		line->bDataBits = 7;
+		break;
+	case CS8:
+	default:
+		line->bDataBits = 8;
+		break;
+	}
+}
+
+static void xr_set_termios_cdc(struct tty_struct *tty,
+			       struct usb_serial_port *port,
+			       struct ktermios *old_termios)
+{
+	struct usb_cdc_line_coding line;
+	int clear = 0, set = 0;
+
+	xr_cdc_line_coding(tty, &line);
+
+	if (!line.dwDTERate) {
+		line.dwDTERate = tty->termios.c_ospeed;
+		clear = TIOCM_DTR;
+	} else {
+		set = TIOCM_DTR;
+	}
+
+	if (clear || set)
+		xr_tiocmset_port(port, set, clear);
+
+	xr_set_flow_mode(tty, port, old_termios);
+
+	xr_usb_serial_ctrl_msg(port, USB_CDC_REQ_SET_LINE_CODING, 0,
+			       &line, sizeof(line));
+}
+
+static void xr_set_termios_format_reg(struct tty_struct *tty,
+				      struct usb_serial_port *port,
+				      struct ktermios *old_termios)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct ktermios *termios = &tty->termios;
+	u8 bits = 0;
+
+	if (!old_termios || (tty->termios.c_ospeed != old_termios->c_ospeed))
+		xr_set_baudrate(tty, port);
+
+	/* For models with a private CHARACTER_FORMAT register */
+
+	switch (C_CSIZE(tty)) {
+	case CS5:
+	case CS6:
+		/* CS5 and CS6 are not supported, so just restore old setting */
+		termios->c_cflag &= ~CSIZE;
+		if (old_termios)
+			termios->c_cflag |= old_termios->c_cflag & CSIZE;
+		else
+			bits |= UART_DATA_8;
+		break;
+	case CS7:
+		bits |= UART_DATA_7;
+		break;
+	case CS8:
+	default:
+		bits |= UART_DATA_8;
+		break;
+	}
+
+	if (C_PARENB(tty)) {
+		if (C_CMSPAR(tty)) {
+			if (C_PARODD(tty))
+				bits |= UART_PARITY_MARK;
+			else
+				bits |= UART_PARITY_SPACE;
+		} else {
+			if (C_PARODD(tty))
+				bits |= UART_PARITY_ODD;
+			else
+				bits |= UART_PARITY_EVEN;
+		}
+	}
+
+	if (C_CSTOPB(tty))
+		bits |= UART_STOP_2;
+	else
+		bits |= UART_STOP_1;
+
+	xr_set_reg_uart(port,
+			xr_hal_table[port_priv->model][REG_FORMAT],
+			bits);
+
+	xr_set_flow_mode(tty, port, old_termios);
+}
+
+/* Time on the wire of one character, for the transmitter drain estimate */
+static void xr_update_char_time(struct tty_struct *tty,
+				struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned int baud = tty_get_baud_rate(tty);
+	unsigned int bits;
+	unsigned long flags;
+	u64 char_ns = 0;
+
+	switch (C_CSIZE(tty)) {
+	case CS5:
+		bits = 5;
+		break;
+	case CS6:
+		bits = 6;
+		break;
+	case CS7:
+		bits = 7;
+		break;
+	default:
+		bits = 8;
+		break;
+	}
+
+	/* Start and stop bits, and parity */
+	bits += C_CSTOPB(tty) ? 3 : 2;
+	if (C_PARENB(tty))
+		bits++;
+
+	if (baud)
+		char_ns = div_u64((u64)bits * NSEC_PER_SEC, baud);
+
+	spin_lock_irqsave(&port->lock, flags);
+	port_priv->tx_char_ns = char_ns;
+	spin_unlock_irqrestore(&port->lock, flags);
+}
+
+static void xr_apply_termios(struct tty_struct *tty,
+			     struct usb_serial_port *port,
+			     struct ktermios *old_termios)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	/*
+	 * Different models have different ways to setup character format:
+	 *
+	 * - XR2280X and XR21V141X have their on private register. On
+	 *   such models, 5-6 bits is not supported;
+	 * - The other models use a standard CDC register.
+	 *
+	 * As we need to do different things with regards to 5-6 bits,
+	 * the actual implementation is made on two different functions.
+	 */
+	if (xr_hal_table[port_priv->model][REG_FORMAT] == VIA_CDC_REGISTER)
+		xr_set_termios_cdc(tty, port, old_termios);
+	else
+		xr_set_termios_format_reg(tty, port, old_termios);
+
+	xr_update_char_time(tty, port);
+}
+
+static void xr_set_termios(struct tty_struct *tty,
+			   struct usb_serial_port *port,
+			   struct ktermios *old_termios)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	bool pending;
+
+	/* A deferred setup programs whatever termios is current by then */
+	xr_cfg_lock(port_priv);
+	pending = port_priv->cfg_pending;
+	if (READ_ONCE(port_priv->ab_state) == XR_AB_RUNNING) {
+		port_priv->ab_overridden = true;
+		WRITE_ONCE(port_priv->ab_abort, true);
+	}
+
+	if (!pending) {
+		struct xr_op_mark mark;
+
+		xr_op_begin(port_priv, &mark);
+		xr_apply_termios(tty, port, old_termios);
+		xr_op_end(port_priv, XR_OP_SET_TERMIOS, &mark, false);
+	}
+	mutex_unlock(&port_priv->cfg_lock);
+
+	xr_msr_watch_cd(port, !C_CLOCAL(tty));
+}
+
+/* Programs the UART from scratch with the current settings */
+static int xr_port_program(struct tty_struct *tty, struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	u8 gpio_dir;
+	int ret;
+
+	ret = xr_uart_enable(port);
+	if (ret) {
+		dev_err(&port->dev, "Failed to enable UART\n");
+		return ret;
+	}
+
+	/*
+	 * Configure DTR and RTS as outputs and RI, CD, DSR and CTS as
+	 * inputs.
+	 */
+	gpio_dir = UART_MODE_DTR | UART_MODE_RTS;
+	xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_GPIO_DIR], gpio_dir);
+
+	ret = fifo_reset(port);
+	if (ret) {
+		dev_err(&port->dev, "Failed to reset FIFO\n");
+		return ret;
+	}
+
+
+	/* Setup termios */
+	if (tty)
+		xr_apply_termios(tty, port, NULL);
+
+	if (xr_has_reg(port_priv, REG_LOW_LATENCY))
+		xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_LOW_LATENCY],
+				port_priv->low_latency);
+
+	return 0;
+}
+
+static int __xr_port_setup(struct tty_struct *tty, struct usb_serial_port *port)
+{
+	unsigned int i;
+	int ret;
+
+	ret = xr_port_program(tty, port);
+	if (ret)
+		return ret;
+
+	/* As usb_serial_generic_open(), within the share of the port */
+	if (!xr_rx_stopped(port))
+		ret = xr_submit_read_urbs(port, GFP_KERNEL);
+	if (ret) {
+		for (i = 0; i < ARRAY_SIZE(port->read_urbs); i++)
+			usb_kill_urb(port->read_urbs[i]);
+		xr_uart_disable(port);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int xr_port_setup(struct tty_struct *tty, struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_op_mark mark;
+	int ret;
+
+	xr_op_begin(port_priv, &mark);
+	ret = __xr_port_setup(tty, port);
+	xr_op_end(port_priv, XR_OP_OPEN, &mark, ret);
+
+	return ret;
+}
+
+/*
+ * Applies a deferred setup: UART enable, GPIO direction, FIFO reset, the
+ * current termios and the recorded modem control changes in one go, then
+ * starts reading and flushes anything written meanwhile.
+ */
+static int xr_apply_config(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct tty_struct *tty;
+	int ret = 0;
+
+	xr_cfg_lock(port_priv);
+	if (!port_priv->cfg_pending)
+		goto out_unlock;
+
+	tty = tty_port_tty_get(&port->port);
+	ret = xr_port_setup(tty, port);
+	if (!ret && (port_priv->cfg_mctrl_set || port_priv->cfg_mctrl_clear))
+		xr_tiocmset_port(port, port_priv->cfg_mctrl_set,
+				 port_priv->cfg_mctrl_clear);
+	tty_kref_put(tty);
+
+	/* Still pending on failure, the next write or ioctl tries again */
+	if (ret) {
+		dev_err(&port->dev, "Deferred setup failed: %d\n", ret);
+		goto out_unlock;
+	}
+
+	WRITE_ONCE(port_priv->cfg_pending, false);
+	smp_mb();
+
+	usb_serial_generic_write_start(port, GFP_KERNEL);
+
+out_unlock:
+	mutex_unlock(&port_priv->cfg_lock);
+
+	return ret;
+}
+
+static void xr_cfg_work(struct work_struct *work)
+{
+	struct xr_port_private *port_priv =
+		container_of(to_delayed_work(work), struct xr_port_private,
+			     cfg_work);
+
+	xr_apply_config(port_priv->port);
+}
+
+/*
+ * Recovery of a wedged channel escalates from clearing the halt of its bulk
+ * endpoints, to reprogramming the UART with the saved configuration, to a
+ * USB reset of the whole device. A step that succeeds but doesn't last,
+ * i.e. the channel is found wedged again within XR_HEALTH_WINDOW_MS, makes
+ * the next recovery start one step further. The reset is opt-in: the
+ * driver has no pre_reset/post_reset handlers, so the core rebinds all the
+ * interfaces of the device and every channel has to be reopened.
+ */
+enum xr_recover_level {
+	XR_RECOVER_CLEAR_HALT,
+	XR_RECOVER_REINIT,
+	XR_RECOVER_RESET,
+};
+
+static const char * const xr_recover_names[] = {
+	[XR_RECOVER_CLEAR_HALT] =	"clear halt",
+	[XR_RECOVER_REINIT] =		"reinit",
+	[XR_RECOVER_RESET] =		"reset",
+};
+
+static bool xr_wedged(struct xr_port_private *port_priv)
+{
+	return test_bit(XR_HEALTH_STALLED, &port_priv->health_flags) ||
+	       test_bit(XR_HEALTH_SILENT, &port_priv->health_flags) ||
+	       atomic_read(&port_priv->ctrl_timeouts) >= XR_HEALTH_CTRL_TIMEOUTS ||
+	       atomic_read(&port_priv->bulk_errors) >= XR_HEALTH_BULK_ERRORS;
+}
+
+static void xr_mctrl_replay(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned int mctrl = READ_ONCE(port_priv->mctrl) & (TIOCM_DTR | TIOCM_RTS);
+
+	xr_tiocmset_port(port, mctrl, ~mctrl & (TIOCM_DTR | TIOCM_RTS));
+}
+
+static int xr_recover(struct usb_serial_port *port, struct tty_struct *tty,
+		      enum xr_recover_level level)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct usb_device *udev = port->serial->dev;
+	unsigned int i;
+	u8 status;
+	int ret;
+
+	switch (level) {
+	case XR_RECOVER_CLEAR_HALT:
+		atomic64_inc(&port_priv->cnt.recover_clear_halt);
+		/* A silent bulk-in still has its URBs queued */
+		for (i = 0; i < ARRAY_SIZE(port->read_urbs); i++)
+			usb_kill_urb(port->read_urbs[i]);
+		ret = usb_clear_halt(udev, usb_rcvbulkpipe(udev,
+					port->bulk_in_endpointAddress));
+		if (ret)
+			return ret;
+		ret = usb_clear_halt(udev, usb_sndbulkpipe(udev,
+					port->bulk_out_endpointAddress));
+		if (ret)
+			return ret;
+		break;
+	case XR_RECOVER_REINIT:
+		atomic64_inc(&port_priv->cnt.recover_reinit);
+		xr_uart_disable(port);
+		ret = xr_port_program(tty, port);
+		if (ret)
+			return ret;
+		xr_mctrl_replay(port);
+		break;
+	case XR_RECOVER_RESET:
+		if (!port_priv->recovery_reset)
+			return -EIO;
+		atomic64_inc(&port_priv->cnt.recover_reset);
+		dev_warn(&port->dev, "Resetting the device\n");
+		usb_queue_reset_device(port->serial->interface);
+		return 0;
+	}
+
+	clear_bit(XR_HEALTH_STALLED, &port_priv->health_flags);
+	clear_bit(XR_HEALTH_SILENT, &port_priv->health_flags);
+	port_priv->health_silent = 0;
+	atomic_set(&port_priv->ctrl_timeouts, 0);
+	atomic_set(&port_priv->bulk_errors, 0);
+
+	/* The channel must answer again */
+	ret = xr_get_reg_uart(port,
+			      xr_hal_table[port_priv->model][REG_GPIO_STATUS],
+			      &status);
+	if (ret)
+		return ret;
+
+	/* Throttled ports are restarted by whoever throttled them */
+	if (!xr_rx_stopped(port)) {
+		ret = xr_submit_read_urbs(port, GFP_KERNEL);
+		if (ret)
+			return ret;
+	}
+
+	usb_serial_generic_write_start(port, GFP_KERNEL);
+
+	return 0;
+}
+
+/*
+ * Run every XR_HEALTH_INTERVAL_MS while the port is open and has
+ * recovery_silent set. Changes of the DSR or CD inputs, with a bulk-in URB
+ * queued all along and none completing, for XR_HEALTH_SILENT_CHECKS
+ * intervals in a row, are taken as a silently stopped bulk-in. Only the
+ * poller cache is used, the chip isn't read for this.
+ */
+static void xr_health_check(struct xr_port_private *port_priv)
+{
+	struct usb_serial_port *port = port_priv->port;
+	unsigned long queued;
+	u8 status, changed;
+	bool cached;
+	s64 urbs;
+
+	spin_lock_irq(&port_priv->msr_lock);
+	cached = xr_msr_poll_wanted(port_priv) && port_priv->msr_valid;
+	status = port_priv->msr;
+	spin_unlock_irq(&port_priv->msr_lock);
+
+	queued = ~READ_ONCE(port->read_urbs_free) &
+		 (BIT(ARRAY_SIZE(port->read_urbs)) - 1);
+
+	/* No data is expected while the port doesn't read */
+	if (!READ_ONCE(port_priv->recovery_silent) || !cached || !queued ||
+	    READ_ONCE(port_priv->cfg_pending) || xr_rx_stopped(port)) {
+		port_priv->health_silent = 0;
+		port_priv->health_msr_valid = false;
+		return;
+	}
+
+	urbs = atomic64_read(&port_priv->cnt.rx_urbs);
+	changed = (status ^ port_priv->health_msr) &
+		  (UART_MODE_DSR | UART_MODE_CD);
+
+	if (port_priv->health_msr_valid && changed &&
+	    urbs == port_priv->health_rx) {
+		if (++port_priv->health_silent >= XR_HEALTH_SILENT_CHECKS)
+			set_bit(XR_HEALTH_SILENT, &port_priv->health_flags);
+	} else {
+		port_priv->health_silent = 0;
+	}
+
+	port_priv->health_msr = status;
+	port_priv->health_msr_valid = true;
+	port_priv->health_rx = urbs;
+}
+
+static void xr_health_work(struct work_struct *work)
+{
+	struct xr_port_private *port_priv =
+		container_of(to_delayed_work(work), struct xr_port_private,
+			     health_work);
+	struct usb_serial_port *port = port_priv->port;
+	unsigned long window = msecs_to_jiffies(XR_HEALTH_WINDOW_MS);
+	unsigned long holdoff = msecs_to_jiffies(XR_HEALTH_INTERVAL_MS);
+	enum xr_recover_level level = XR_RECOVER_CLEAR_HALT;
+	enum xr_recover_level top = XR_RECOVER_RESET;
+	struct xr_op_mark mark;
+	struct tty_struct *tty;
+	int ret = -EIO;
+
+	if (!tty_port_initialized(&port->port))
+		return;
+
+	if (!xr_wedged(port_priv)) {
+		xr_health_check(port_priv);
+		if (!xr_wedged(port_priv))
+			goto rearm;
+	}
+
+	/* At most one recovery per interval */
+	if (port_priv->health_last &&
+	    time_before(jiffies, port_priv->health_last + holdoff)) {
+		queue_delayed_work(system_long_wq, &port_priv->health_work,
+				   port_priv->health_last + holdoff - jiffies);
+		return;
+	}
+
+	/* Silence alone is a guess: the reads are restarted, nothing reset */
+	if (test_bit(XR_HEALTH_SILENT, &port_priv->health_flags) &&
+	    !test_bit(XR_HEALTH_STALLED, &port_priv->health_flags) &&
+	    atomic_read(&port_priv->ctrl_timeouts) < XR_HEALTH_CTRL_TIMEOUTS &&
+	    atomic_read(&port_priv->bulk_errors) < XR_HEALTH_BULK_ERRORS)
+		top = XR_RECOVER_CLEAR_HALT;
+
+	if (port_priv->health_last &&
+	    time_before(jiffies, port_priv->health_last + window))
+		level = min(port_priv->health_level + 1, (unsigned int)top);
+
+	atomic64_inc(&port_priv->cnt.wedges);
+
+	tty = tty_port_tty_get(&port->port);
+	xr_cfg_lock(port_priv);
+
+	/* Nothing was programmed yet */
+	if (port_priv->cfg_pending) {
+		mutex_unlock(&port_priv->cfg_lock);
+		tty_kref_put(tty);
+		goto rearm;
+	}
+
+	xr_op_begin(port_priv, &mark);
+	for (; level <= top; level++) {
+		ret = xr_recover(port, tty, level);
+		if (!ret)
+			break;
+	}
+	if (level > top)
+		level = top;
+	xr_op_end(port_priv, XR_OP_WEDGE_RECOVERY, &mark, ret);
+
+	mutex_unlock(&port_priv->cfg_lock);
+	tty_kref_put(tty);
+
+	port_priv->health_level = level;
+	port_priv->health_last = jiffies;
+
+	if (ret)
+		dev_err(&port->dev, "Wedged, recovery failed: %d\n", ret);
+	else
+		dev_info(&port->dev, "Wedged, recovered by %s\n",
+			 xr_recover_names[level]);
+
+rearm:
+	/* The other signs kick the work themselves */
+	if (READ_ONCE(port_priv->recovery_silent))
+		queue_delayed_work(system_long_wq, &port_priv->health_work,
+				   holdoff);
+}
+
+/*
+ * Automatic baud rate detection: the port listens at each candidate rate
+ * for a while, with the received data kept from the tty, and locks onto
+ * the rate whose data looks least like the result of sampling at a wrong
+ * rate. None of the models reports framing or parity errors per byte, so
+ * the data itself is scored: a receiver that is too slow mostly sees 0x00
+ * and breaks, one that is too fast sees runs of ones, i.e. 0x80, 0xc0,
+ * 0xe0 ... 0xff. The generator settings of all rates are computed before
+ * the sweep, so switching takes only the register writes. A termios change
+ * during the sweep aborts it and is kept.
+ */
+static const u32 xr_autobaud_rates[] = {
+	1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800,
+	921600,
+};
+
+#define XR_AUTOBAUD_MIN_BYTES	8
+#define XR_AUTOBAUD_SURE_BYTES	32
+#define XR_AUTOBAUD_MAX_DWELL_MS	1000
+
+static bool xr_autobaud_suspect(u8 c)
+{
+	return !c || ((c & 0x80) && (u8)(c | (c - 1)) == 0xff);
+}
+
+static void xr_autobaud_rx(struct xr_port_private *port_priv,
+			   const unsigned char *data, unsigned int len)
+{
+	unsigned int i, suspect = 0;
+
+	/* Data arriving while the rate is switched is simply dropped */
+	if (!READ_ONCE(port_priv->ab_sampling))
+		return;
+
+	for (i = 0; i < len; i++)
+		if (xr_autobaud_suspect(data[i]))
+			suspect++;
+
+	atomic_add(len, &port_priv->ab_bytes);
+	atomic_add(suspect, &port_priv->ab_suspect);
+}
+
+static int xr_autobaud_set(struct usb_serial_port *port,
+			   const struct usb_cdc_line_coding *line,
+			   const struct xr_baud_regs *regs, u32 baud)
+{
+	struct usb_cdc_line_coding coding = *line;
+
+	if (!regs) {
+		coding.dwDTERate = cpu_to_le32(baud);
+		return xr_usb_serial_ctrl_msg(port, USB_CDC_REQ_SET_LINE_CODING,
+					      0, &coding, sizeof(coding));
+	}
+
+	return xr_write_baudrate(port, regs);
+}
+
+static void xr_autobaud_work(struct work_struct *work)
+{
+	struct xr_port_private *port_priv =
+		container_of(work, struct xr_port_private, ab_work);
+	struct xr_baud_regs regs[ARRAY_SIZE(xr_autobaud_rates)];
+	struct usb_serial_port *port = port_priv->port;
+	unsigned int bytes, suspect, best_good = 0;
+	int i, best = -1, ret = 0;
+	struct usb_cdc_line_coding line;
+	struct tty_struct *tty;
+	u32 baud = 0;
+	bool cdc;
+
+	tty = tty_port_tty_get(&port->port);
+	if (!tty || xr_apply_config(port)) {
+		tty_kref_put(tty);
+		WRITE_ONCE(port_priv->ab_state, XR_AB_FAILED);
+		return;
+	}
+
+	cdc = xr_hal_table[port_priv->model][REG_FORMAT] == VIA_CDC_REGISTER;
+	xr_cdc_line_coding(tty, &line);
+	for (i = 0; i < ARRAY_SIZE(xr_autobaud_rates); i++)
+		xr_calc_baudrate(xr_autobaud_rates[i], &regs[i]);
+
+	/* Only each rate switch is locked, not the sampling */
+	for (i = 0; i < ARRAY_SIZE(xr_autobaud_rates); i++) {
+		xr_cfg_lock(port_priv);
+		if (READ_ONCE(port_priv->ab_abort)) {
+			mutex_unlock(&port_priv->cfg_lock);
+			break;
+		}
+
+		ret = xr_autobaud_set(port, &line, cdc ? NULL : &regs[i],
+				      xr_autobaud_rates[i]);
+		if (!ret) {
+			fifo_reset(port);
+			atomic_set(&port_priv->ab_bytes, 0);
+			atomic_set(&port_priv->ab_suspect, 0);
+			WRITE_ONCE(port_priv->ab_sampling, true);
+		}
+		mutex_unlock(&port_priv->cfg_lock);
+		if (ret)
+			break;
+
+		msleep(port_priv->ab_dwell_ms);
+
+		WRITE_ONCE(port_priv->ab_sampling, false);
+		bytes = atomic_read(&port_priv->ab_bytes);
+		suspect = atomic_read(&port_priv->ab_suspect);
+
+		dev_dbg(&port->dev, "Auto-baud %u: %u bytes, %u suspect\n",
+			xr_autobaud_rates[i], bytes, suspect);
+
+		/* At most one byte in eight may look like a sampling error */
+		if (bytes < XR_AUTOBAUD_MIN_BYTES || suspect * 8 > bytes)
+			continue;
+
+		if (bytes - suspect > best_good) {
+			best_good = bytes - suspect;
+			best = i;
+		}
+
+		if (bytes >= XR_AUTOBAUD_SURE_BYTES && !suspect)
+			break;
+	}
+
+	WRITE_ONCE(port_priv->ab_sampling, false);
+
+	xr_cfg_lock(port_priv);
+
+	if (port_priv->ab_overridden) {
+		/* The new termios is programmed already */
+		best = -1;
+	} else if (best >= 0) {
+		baud = xr_autobaud_rates[best];
+		ret = xr_autobaud_set(port, &line, cdc ? NULL : &regs[best],
+				      baud);
+	} else {
+		/* Back to the rate of the termios */
+		xr_apply_termios(tty, port, NULL);
+	}
+
+	mutex_unlock(&port_priv->cfg_lock);
+
+	if (best >= 0 && !ret) {
+		down_write(&tty->termios_rwsem);
+		tty_encode_baud_rate(tty, baud, baud);
+		up_write(&tty->termios_rwsem);
+		xr_update_char_time(tty, port);
+
+		port_priv->ab_baud = baud;
+		WRITE_ONCE(port_priv->ab_state, XR_AB_LOCKED);
+		dev_info(&port->dev, "Auto-baud locked at %u\n", baud);
+	} else {
+		WRITE_ONCE(port_priv->ab_state, XR_AB_FAILED);
+	}
+
+	tty_kref_put(tty);
+}
+
+/* While the setup is deferred, the reads are started by the setup */
+static void xr_unthrottle(struct tty_struct *tty)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	bool pending;
+
+	xr_cfg_lock(port_priv);
+	pending = port_priv->cfg_pending;
+	clear_bit(USB_SERIAL_THROTTLED, &port->flags);
+	/* Matches the smp_mb__after_atomic() in xr_read_bulk_callback() */
+	smp_mb__after_atomic();
+	mutex_unlock(&port_priv->cfg_lock);
+
+	if (!pending && !xr_rx_stopped(port))
+		xr_rx_restart(port, GFP_KERNEL);
+}
+
+static void xr_break_ctl(struct tty_struct *tty, int break_state)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	u8 state;
+
+	/* The break needs a running UART */
+	if (xr_apply_config(port))
+		return;
+
+	/* A CDC break lasts for wValue ms, 0xffff meaning until cleared */
+	if (port_priv->model != XR21V141X) {
+		xr_usb_serial_ctrl_msg(port, USB_CDC_REQ_SEND_BREAK,
+				       break_state ? 0xffff : 0, NULL, 0);
+		return;
+	}
+
+	if (break_state == 0)
+		state = UART_BREAK_OFF;
+	else
+		state = UART_BREAK_ON;
+
+	dev_dbg(&port->dev, "Turning break %s\n",
+		state == UART_BREAK_OFF ? "off" : "on");
+	xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_TX_BREAK],
+			state);
+}
+
+/*
+ * Register snapshots
+ *
+ * The registers are read with one control URB each, all of them in flight
+ * at once, so a snapshot costs about one round trip instead of one per
+ * register. None of the supported models document multi-byte vendor
+ * reads, so that is the only method.
+ */
+struct xr_reg_read {
+	struct urb *urb;
+	struct usb_ctrlrequest *dr;
+	u8 *buf;
+	u16 reg;
+	u8 block;
+};
+
+static void xr_reg_read_callback(struct urb *urb)
+{
+}
+
+static int xr_fill_reg_read(struct usb_serial_port *port,
+			    struct xr_reg_read *rd, u8 block, u16 reg)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct usb_device *udev = port->serial->dev;
+	int index;
+
+	index = xr_reg_index(port, block, reg);
+	if (index < 0)
+		return index;
+
+	rd->urb = xr_alloc_urb(GFP_KERNEL);
+	rd->dr = kmalloc(sizeof(*rd->dr), GFP_KERNEL);
+	rd->buf = kmalloc(1, GFP_KERNEL);
+	if (!rd->urb || !rd->dr || !rd->buf)
+		return -ENOMEM;
+
+	rd->dr->bRequestType = USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE;
+	rd->dr->bRequest = xr_hal_table[port_priv->model][REQ_GET];
+	rd->dr->wValue = 0;
+	rd->dr->wIndex = cpu_to_le16(index);
+	rd->dr->wLength = cpu_to_le16(1);
+
+	usb_fill_control_urb(rd->urb, udev, usb_rcvctrlpipe(udev, 0),
+			     (unsigned char *)rd->dr, rd->buf, 1,
+			     xr_reg_read_callback, rd);
+	rd->block = block;
+	rd->reg = reg;
+
+	return 0;
+}
+
+static const u16 xr_clock_regs[] = {
+	CLOCK_DIVISOR_0, CLOCK_DIVISOR_1, CLOCK_DIVISOR_2,
+	TX_CLOCK_MASK_0, TX_CLOCK_MASK_1, RX_CLOCK_MASK_0, RX_CLOCK_MASK_1,
+};
+
+/* Returns the number of records stored in rec, or a negative error */
+static int xr_read_regs(struct usb_serial_port *port,
+			struct xr_reg_record *rec, unsigned int max)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned int i, n = 0, count = 0;
+	struct xr_reg_read *rd;
+	struct usb_anchor anchor;
+	int type, ret = 0;
+
+	rd = kcalloc(max, sizeof(*rd), GFP_KERNEL);
+	if (!rd)
+		return -ENOMEM;
+
+	for (type = REG_ENABLE; type < REQ_SET && !ret; type++) {
+		if (!xr_has_reg(port_priv, type))
+			continue;
+		ret = xr_fill_reg_read(port, &rd[n++], UART_REG_BLOCK,
+				       xr_hal_table[port_priv->model][type]);
+	}
+
+	/* The divisor registers only exist on the non-CDC models */
+	if (xr_has_reg(port_priv, REG_FORMAT)) {
+		for (i = 0; i < ARRAY_SIZE(xr_clock_regs) && !ret; i++)
+			ret = xr_fill_reg_read(port, &rd[n++], UART_REG_BLOCK,
+					       xr_clock_regs[i]);
+	}
+
+	if (port_priv->model == XR21V141X && !ret)
+		ret = xr_fill_reg_read(port, &rd[n++], UM_REG_BLOCK,
+				       UM_FIFO_ENABLE_REG);
+
+	if (ret)
+		goto out_free;
+
+	init_usb_anchor(&anchor);
+	for (i = 0; i < n; i++) {
+		usb_anchor_urb(rd[i].urb, &anchor);
+		ret = usb_submit_urb(rd[i].urb, GFP_KERNEL);
+		if (ret) {
+			usb_unanchor_urb(rd[i].urb);
+			break;
+		}
+	}
+
+	if (!usb_wait_anchor_empty_timeout(&anchor, USB_CTRL_GET_TIMEOUT)) {
+		usb_kill_anchored_urbs(&anchor);
+		ret = -ETIMEDOUT;
+	}
+
+	if (ret)
+		goto out_free;
+
+	for (i = 0; i < n; i++) {
+		if (rd[i].urb->status || rd[i].urb->actual_length != 1)
+			continue;
+
+		rec[count].reg = cpu_to_le16(rd[i].reg);
+		rec[count].block = rd[i].block;
+		rec[count].value = rd[i].buf[0];
+		count++;
+	}
+	ret = count;
+
+out_free:
+	for (i = 0; i < n; i++) {
+		xr_free_urb(rd[i].urb);
+		kfree(rd[i].dr);
+		kfree(rd[i].buf);
+	}
+	kfree(rd);
+
+	return ret;
+}
+
+#define XR_MAX_DUMP_REGS	(REQ_SET + ARRAY_SIZE(xr_clock_regs) + 1)
+
+struct xr_reg_dump {
+	size_t len;
+	struct xr_reg_record rec[XR_MAX_DUMP_REGS];
+};
+
+static int xr_registers_open(struct inode *inode, struct file *file)
+{
+	struct usb_serial_port *port = inode->i_private;
+	struct xr_reg_dump *dump;
+	int ret;
+
+	dump = kzalloc(sizeof(*dump), GFP_KERNEL);
+	if (!dump)
+		return -ENOMEM;
+
+	ret = xr_read_regs(port, dump->rec, XR_MAX_DUMP_REGS);
+	if (ret < 0) {
+		kfree(dump);
+		return ret;
+	}
+
+	dump->len = ret * sizeof(dump->rec[0]);
+	file->private_data = dump;
+
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t xr_registers_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct xr_reg_dump *dump = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, dump->rec, dump->len);
+}
+
+static int xr_registers_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+
+	return 0;
+}
+
+static const struct file_operations xr_registers_fops = {
+	.owner		= THIS_MODULE,
+	.open		= xr_registers_open,
+	.read		= xr_registers_read,
+	.release	= xr_registers_release,
+	.llseek		= no_llseek,
+};
+
+static int xr_timings_show(struct seq_file *s, void *unused)
+{
+	struct usb_serial_port *port = s->private;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_op_stats st[XR_OP_MAX];
+	int op;
+
+	spin_lock_irq(&port_priv->stats_lock);
+	memcpy(st, port_priv->op_stats, sizeof(st));
+	spin_unlock_irq(&port_priv->stats_lock);
+
+	seq_puts(s, "op            count     errors    last_us   max_us    avg_us    vendor    cdc\n");
+	for (op = 0; op < XR_OP_MAX; op++)
+		seq_printf(s, "%-12s  %-8llu  %-8llu  %-8llu  %-8llu  %-8llu  %-8llu  %llu\n",
+			   xr_op_names[op], st[op].count, st[op].errors,
+			   div_u64(st[op].last_ns, NSEC_PER_USEC),
+			   div_u64(st[op].max_ns, NSEC_PER_USEC),
+			   st[op].count ?
+			   div64_u64(st[op].total_ns,
+				     st[op].count * NSEC_PER_USEC) : 0,
+			   st[op].ctrl_vendor, st[op].ctrl_cdc);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xr_timings);
+
+static const char * const xr_model_names[] = {
+	[XR2280X] =	"XR2280X",
+	[XR21B1411] =	"XR21B1411",
+	[XR21V141X] =	"XR21V141X",
+	[XR21B142X] =	"XR21B142X",
+};
+
+#define XR_STATS_HEADER \
+	"port       model      ch  rx_bytes    rx_urbs   rx_us     pushes    tx_bytes    tx_urbs   ctrl   cdc    ctrl_us   cfg_waits cfg_wait_us\n"
+
+static void xr_stats_line(struct seq_file *s, struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_counters *cnt = &port_priv->cnt;
+
+	seq_printf(s, "%-10s %-10s %-3u %-11lld %-9lld %-9lld %-9lld %-11lld %-9lld %-6lld %-6lld %-9lld %-9lld %lld\n",
+		   dev_name(&port->dev), xr_model_names[port_priv->model],
+		   port_priv->channel,
+		   atomic64_read(&cnt->rx_bytes),
+		   atomic64_read(&cnt->rx_urbs),
+		   div_s64(atomic64_read(&cnt->rx_ns), NSEC_PER_USEC),
+		   atomic64_read(&cnt->rx_pushes),
+		   atomic64_read(&cnt->tx_bytes),
+		   atomic64_read(&cnt->tx_urbs),
+		   atomic64_read(&cnt->ctrl_xfers),
+		   atomic64_read(&cnt->ctrl_cdc),
+		   div_s64(atomic64_read(&cnt->ctrl_ns), NSEC_PER_USEC),
+		   atomic64_read(&cnt->cfg_contended),
+		   div_s64(atomic64_read(&cnt->cfg_wait_ns), NSEC_PER_USEC));
+}
+
+static int xr_stats_show(struct seq_file *s, void *unused)
+{
+	seq_puts(s, XR_STATS_HEADER);
+	xr_stats_line(s, s->private);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xr_stats);
+
+static int xr_bridge_show(struct seq_file *s, void *unused)
+{
+	struct usb_serial_port *port = s->private;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_counters *cnt = &port_priv->cnt;
+	struct xr_port_private *peer;
+
+	rcu_read_lock();
+	peer = rcu_dereference(port_priv->bridge);
+	seq_printf(s, "peer:      %s\n",
+		   peer ? dev_name(&peer->port->dev) : "none");
+	rcu_read_unlock();
+
+	seq_printf(s, "bytes:     %lld\n", atomic64_read(&cnt->bridge_bytes));
+	seq_printf(s, "dropped:   %lld\n", atomic64_read(&cnt->bridge_drops));
+	seq_printf(s, "throttled: %lld\n",
+		   atomic64_read(&cnt->bridge_throttles));
+	seq_printf(s, "stopped:   %d\n",
+		   test_bit(XR_RX_STOP_BRIDGE, &port_priv->rx_stop));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xr_bridge);
+
+static int xr_health_show(struct seq_file *s, void *unused)
+{
+	struct usb_serial_port *port = s->private;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_counters *cnt = &port_priv->cnt;
+
+	seq_printf(s, "stalled:       %d\n",
+		   test_bit(XR_HEALTH_STALLED, &port_priv->health_flags));
+	seq_printf(s, "silent:        %d (%u checks)\n",
+		   test_bit(XR_HEALTH_SILENT, &port_priv->health_flags),
+		   port_priv->health_silent);
+	seq_printf(s, "ctrl_timeouts: %d\n",
+		   atomic_read(&port_priv->ctrl_timeouts));
+	seq_printf(s, "bulk_errors:   %d\n", atomic_read(&port_priv->bulk_errors));
+	seq_printf(s, "wedges:        %lld\n", atomic64_read(&cnt->wedges));
+	seq_printf(s, "clear_halt:    %lld\n",
+		   atomic64_read(&cnt->recover_clear_halt));
+	seq_printf(s, "reinit:        %lld\n",
+		   atomic64_read(&cnt->recover_reinit));
+	seq_printf(s, "reset:         %lld\n",
+		   atomic64_read(&cnt->recover_reset));
+	seq_printf(s, "last_step:     %s\n", port_priv->health_last ?
+		   xr_recover_names[port_priv->health_level] : "none");
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xr_health);
+
+/* Per second rates of the completed slots, newest first */
+static int xr_rates_show(struct seq_file *s, void *unused)
+{
+	struct usb_serial_port *port = s->private;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned long epoch = jiffies / XR_RATE_SLOT_JIFFIES;
+	unsigned long e;
+	unsigned int i, r;
+	int val[XR_RATE_MAX];
+
+	seq_puts(s, "age_ms  rx_Bps      rx_urbs/s  tx_Bps      tx_urbs/s  errors/s\n");
+
+	for (i = 1; i < XR_RATE_SLOTS; i++) {
+		struct xr_rate_slot *slot;
+
+		e = epoch - i;
+		slot = &port_priv->rates[e % XR_RATE_SLOTS];
+
+		for (r = 0; r < XR_RATE_MAX; r++)
+			val[r] = atomic_read(&slot->val[r]);
+
+		/* Nothing happened in an untouched slot */
+		if (atomic_long_read(&slot->epoch) != e)
+			memset(val, 0, sizeof(val));
+
+		seq_printf(s, "%-7u %-11d %-10d %-11d %-10d %d\n", i * 100,
+			   val[XR_RATE_RX_BYTES] * 10,
+			   val[XR_RATE_RX_URBS] * 10,
+			   val[XR_RATE_TX_BYTES] * 10,
+			   val[XR_RATE_TX_URBS] * 10,
+			   val[XR_RATE_ERRORS] * 10);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xr_rates);
+
+static int xr_echo_show(struct seq_file *s, void *unused)
+{
+	struct usb_serial_port *port = s->private;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_counters *cnt = &port_priv->cnt;
+
+	seq_printf(s, "enabled:    %d\n", port_priv->rs485_echo);
+	seq_printf(s, "dropped:    %lld\n", atomic64_read(&cnt->echo_bytes));
+	seq_printf(s, "collisions: %lld\n",
+		   atomic64_read(&cnt->echo_collisions));
+	seq_printf(s, "lost:       %lld\n", atomic64_read(&cnt->echo_lost));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xr_echo);
+
+/* One line per port, so that hundreds of ports are read in one go */
+static int xr_ports_show(struct seq_file *s, void *unused)
+{
+	struct xr_port_private *port_priv;
+
+	seq_puts(s, XR_STATS_HEADER);
+
+	mutex_lock(&xr_port_list_lock);
+	list_for_each_entry(port_priv, &xr_port_list, node)
+		xr_stats_line(s, port_priv->port);
+	mutex_unlock(&xr_port_list_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xr_ports);
+
+/* The bulk-in shares of all ports, see xr_rx_resubmit_ns() */
+static int xr_shares_show(struct seq_file *s, void *unused)
+{
+	unsigned long epoch = jiffies / XR_RATE_SLOT_JIFFIES;
+	struct xr_port_private *port_priv;
+	struct usb_serial_port *port;
+	int used = 0;
+
+	if (atomic_long_read(&xr_rx_window.epoch) == epoch)
+		used = atomic_read(&xr_rx_window.bytes);
+
+	seq_printf(s, "budget_Bps: %llu\n", (u64)READ_ONCE(rx_budget_kbps) * 1000);
+	seq_printf(s, "slot_bytes: %d\n", used);
+	seq_printf(s, "weights:    %u\n", READ_ONCE(xr_rx_weights));
+	seq_puts(s, "port       open weight urbs urb_size pace_us paced      arbitrated\n");
+
+	mutex_lock(&xr_port_list_lock);
+	list_for_each_entry(port_priv, &xr_port_list, node) {
+		port = port_priv->port;
+		seq_printf(s, "%-10s %-4d %-6u %-4u %-8u %-7u %-10lld %lld\n",
+			   dev_name(&port->dev), port_priv->rx_weighted,
+			   port_priv->rx_weight, port_priv->rx_urbs,
+			   port_priv->rx_urb_size, port_priv->rx_pace_us,
+			   atomic64_read(&port_priv->cnt.rx_paced),
+			   atomic64_read(&port_priv->cnt.rx_arbitrated));
+	}
+	mutex_unlock(&xr_port_list_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xr_shares);
+
+/* Upper bound, in ns, of the bucket holding the given per-mille rank */
+static u64 xr_hist_percentile(const unsigned long *bucket, unsigned long total,
+			      unsigned int permille)
+{
+	u64 rank = DIV_ROUND_UP_ULL((u64)total * permille, 1000);
+	unsigned long sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < XR_HIST_BUCKETS; i++) {
+		sum += bucket[i];
+		if (sum >= rank)
+			break;
+	}
+
+	return 2ULL << min(i, XR_HIST_BUCKETS - 1U);
+}
+
+static void xr_hist_show(struct seq_file *s, const char *name,
+			 struct xr_hist *hist)
+{
+	unsigned long bucket[XR_HIST_BUCKETS], total = 0;
+	unsigned int i;
+
+	for (i = 0; i < XR_HIST_BUCKETS; i++) {
+		bucket[i] = atomic_long_read(&hist->bucket[i]);
+		total += bucket[i];
+	}
+
+	seq_printf(s, "%-6s %-10lu", name, total);
+	if (total)
+		seq_printf(s, " %-10llu %-10llu %-10llu %llu",
+			   div_u64(xr_hist_percentile(bucket, total, 500), NSEC_PER_USEC),
+			   div_u64(xr_hist_percentile(bucket, total, 900), NSEC_PER_USEC),
+			   div_u64(xr_hist_percentile(bucket, total, 990), NSEC_PER_USEC),
+			   div_u64(xr_hist_percentile(bucket, total, 999), NSEC_PER_USEC));
+	seq_putc(s, '\n');
+}
+
+/*
+ * Latency percentiles since the last reset, as bucket upper bounds. A soak
+ * run samples and resets this file periodically to follow the drift. The
+ * svc line is the time from a bulk-in completion to its resubmission.
+ */
+static int xr_latency_show(struct seq_file *s, void *unused)
+{
+	struct usb_serial_port *port = s->private;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	seq_puts(s, "path   samples    p50_us     p90_us     p99_us     p999_us\n");
+	xr_hist_show(s, "ctrl", &port_priv->ctrl_hist);
+	xr_hist_show(s, "rx", &port_priv->rx_hist);
+	xr_hist_show(s, "svc", &port_priv->svc_hist);
+
+	return 0;
+}
+
+static int xr_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, xr_latency_show, inode->i_private);
+}
+
+static ssize_t xr_latency_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct usb_serial_port *port = s->private;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned int i;
+
+	for (i = 0; i < XR_HIST_BUCKETS; i++) {
+		atomic_long_set(&port_priv->ctrl_hist.bucket[i], 0);
+		atomic_long_set(&port_priv->rx_hist.bucket[i], 0);
+		atomic_long_set(&port_priv->svc_hist.bucket[i], 0);
+	}
+
+	return count;
+}
+
+static const struct file_operations xr_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= xr_latency_open,
+	.read		= seq_read,
+	.write		= xr_latency_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int xr_resources_show(struct seq_file *s, void *unused)
+{
+	seq_printf(s, "live_urbs %d\n", atomic_read(&xr_live_urbs));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xr_resources);
+
+static int xr_parse_format(const char *buf, tcflag_t *cflag)
+{
+	tcflag_t c;
+
+	if (strlen(buf) < 3 || (buf[3] && buf[3] != '\n'))
+		return -EINVAL;
+
+	switch (buf[0]) {
+	case '5':
+		c = CS5;
+		break;
+	case '6':
+		c = CS6;
+		break;
+	case '7':
+		c = CS7;
+		break;
+	case '8':
+		c = CS8;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	switch (toupper(buf[1])) {
+	case 'N':
+		break;
+	case 'O':
+		c |= PARENB | PARODD;
+		break;
+	case 'E':
+		c |= PARENB;
+		break;
+	case 'M':
+		c |= PARENB | CMSPAR | PARODD;
+		break;
+	case 'S':
+		c |= PARENB | CMSPAR;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	switch (buf[2]) {
+	case '1':
+		break;
+	case '2':
+		c |= CSTOPB;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	*cflag = c;
+
+	return 0;
+}
+
+static void xr_init_defaults(struct usb_interface *intf,
+			     struct xr_port_private *port_priv)
+{
+	int ret;
+
+	port_priv->def_baud = default_baud;
+	port_priv->def_flow = -1;
+	port_priv->low_latency = default_low_latency;
+	port_priv->rs485 = default_rs485;
+	port_priv->rs485_delay = min(default_rs485_delay, 0xffU);
+
+	if (default_format && *default_format) {
+		if (xr_parse_format(default_format, &port_priv->def_cflag))
+			dev_warn(&intf->dev, "Invalid default_format: %s\n",
+				 default_format);
+		else
+			port_priv->def_format = true;
+	}
+
+	if (default_flow && *default_flow) {
+		ret = match_string(xr_flow_names, ARRAY_SIZE(xr_flow_names),
+				   default_flow);
+		if (ret < 0)
+			dev_warn(&intf->dev, "Invalid default_flow: %s\n",
+				 default_flow);
+		else
+			port_priv->def_flow = ret;
+	}
+}
+
+/*
+ * The configured defaults are written to the termios on the first open
+ * after probe, or after they were changed, so the setup below programs
+ * them together with everything else.
+ */
+static void xr_apply_defaults(struct tty_struct *tty,
+			      struct xr_port_private *port_priv)
+{
+	struct ktermios *termios = &tty->termios;
+
+	if (port_priv->def_applied)
+		return;
+	port_priv->def_applied = true;
+
+	down_write(&tty->termios_rwsem);
+
+	if (port_priv->def_baud)
+		tty_termios_encode_baud_rate(termios, port_priv->def_baud,
+					     port_priv->def_baud);
+
+	if (port_priv->def_format) {
+		termios->c_cflag &= ~XR_FORMAT_CFLAGS;
+		termios->c_cflag |= port_priv->def_cflag;
+	}
+
+	switch (port_priv->def_flow) {
+	case XR_FLOW_NONE:
+		termios->c_cflag &= ~CRTSCTS;
+		termios->c_iflag &= ~(IXON | IXOFF);
+		break;
+	case XR_FLOW_RTSCTS:
+		termios->c_cflag |= CRTSCTS;
+		termios->c_iflag &= ~(IXON | IXOFF);
+		break;
+	case XR_FLOW_XONXOFF:
+		termios->c_cflag &= ~CRTSCTS;
+		termios->c_iflag |= IXON | IXOFF;
+		break;
+	}
+
+	up_write(&tty->termios_rwsem);
+}
+
+static int xr_open(struct tty_struct *tty, struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int ret;
+
+	if (tty)
+		xr_apply_defaults(tty, port_priv);
+
+	clear_bit(XR_HEALTH_STALLED, &port_priv->health_flags);
+	clear_bit(XR_HEALTH_SILENT, &port_priv->health_flags);
+	atomic_set(&port_priv->ctrl_timeouts, 0);
+	atomic_set(&port_priv->bulk_errors, 0);
+	port_priv->health_last = 0;
+	port_priv->health_silent = 0;
+	port_priv->health_msr_valid = false;
+	if (READ_ONCE(port_priv->recovery_silent))
+		queue_delayed_work(system_long_wq, &port_priv->health_work,
+				   msecs_to_jiffies(XR_HEALTH_INTERVAL_MS));
+
+	/* A deferred setup honours a throttle from before it ran */
+	clear_bit(USB_SERIAL_THROTTLED, &port->flags);
+
+	xr_rx_share_join(port_priv, true);
+
+	if (!lazy_config_ms) {
+		ret = xr_port_setup(tty, port);
+		if (ret)
+			xr_rx_share_join(port_priv, false);
+		return ret;
+	}
+
+	xr_cfg_lock(port_priv);
+	port_priv->cfg_pending = true;
+	port_priv->cfg_mctrl_set = 0;
+	port_priv->cfg_mctrl_clear = 0;
+	mutex_unlock(&port_priv->cfg_lock);
+
+	schedule_delayed_work(&port_priv->cfg_work,
+			      msecs_to_jiffies(lazy_config_ms));
+
+	return 0;
+}
+
+/*
+ * Transceivers that can't turn their receiver off while transmitting send
+ * every byte back. With echo suppression on, written data is remembered
+ * and the same bytes are dropped from the start of the received data
+ * before anything else sees them. A byte that differs from the expected
+ * one means another node was talking at the same time: it is counted as
+ * a collision and, like everything after it, delivered. An echo that
+ * didn't arrive in time is counted as lost.
+ */
+#define XR_ECHO_FIFO_SIZE	4096
+#define XR_ECHO_SLACK_MS	20
+
+static void xr_echo_queue(struct usb_serial_port *port,
+			  const unsigned char *buf, unsigned int len)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	ktime_t now = ktime_get();
+	unsigned long flags;
+
+	spin_lock_irqsave(&port_priv->echo_lock, flags);
+
+	if (kfifo_in(&port_priv->echo_fifo, buf, len) < len) {
+		/* Too far behind to make sense of it, start over */
+		kfifo_reset(&port_priv->echo_fifo);
+		atomic64_inc(&port_priv->cnt.echo_lost);
+	}
+
+	if (ktime_before(port_priv->echo_deadline, now))
+		port_priv->echo_deadline = now;
+	port_priv->echo_deadline = ktime_add_ns(port_priv->echo_deadline,
+						len * port_priv->tx_char_ns);
+
+	spin_unlock_irqrestore(&port_priv->echo_lock, flags);
+}
+
+/* Returns the number of leading bytes that are echo */
+static unsigned int xr_echo_strip(struct usb_serial_port *port,
+				  const unsigned char *data, unsigned int len)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct kfifo *fifo = &port_priv->echo_fifo;
+	unsigned int done = 0, n, i;
+	unsigned char expect[64];
+	unsigned long flags;
+	ktime_t deadline;
+
+	spin_lock_irqsave(&port_priv->echo_lock, flags);
+
+	deadline = ktime_add_ms(port_priv->echo_deadline, XR_ECHO_SLACK_MS);
+	if (!kfifo_is_empty(fifo) && ktime_after(ktime_get(), deadline)) {
+		kfifo_reset(fifo);
+		atomic64_inc(&port_priv->cnt.echo_lost);
+	}
+
+	while (done < len) {
+		n = kfifo_out_peek(fifo, expect,
+				   min_t(unsigned int, len - done,
+					 sizeof(expect)));
+		if (!n)
+			break;
+
+		for (i = 0; i < n && data[done + i] == expect[i]; i++)
+			;
+
+		if (i < n) {
+			kfifo_reset(fifo);
+			atomic64_inc(&port_priv->cnt.echo_collisions);
+			done += i;
+			break;
+		}
+
+		/* Drop the matched bytes */
+		n = kfifo_out(fifo, expect, i);
+		done += i;
+	}
+
+	spin_unlock_irqrestore(&port_priv->echo_lock, flags);
+
+	atomic64_add(done, &port_priv->cnt.echo_bytes);
+
+	return done;
+}
+
+/*
+ * As usb_serial_generic_write(), but nothing is queued while an ioctl owns
+ * the transmitter, see xr_tx_claim(). The writer is woken up once it is
+ * released.
+ */
+static int xr_write_queue(struct usb_serial_port *port,
+			  const unsigned char *buf, int count)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (port_priv->tx_claimed)
+		count = 0;
+	else
+		count = kfifo_in(&port->write_fifo, buf, count);
+
+	/*
+	 * Only what was queued is expected back, recorded before a write
+	 * completion can send it out.
+	 */
+	if (count && READ_ONCE(port_priv->rs485_echo))
+		xr_echo_queue(port, buf, count);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	return count;
+}
+
+static int xr_write(struct tty_struct *tty, struct usb_serial_port *port,
+		    const unsigned char *buf, int count)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int ret;
+
+	count = xr_write_queue(port, buf, count);
+
+	/*
+	 * Writes may come from atomic context, so while the setup is still
+	 * deferred the data is only queued and the setup is kicked off.
+	 */
+	if (READ_ONCE(port_priv->cfg_pending)) {
+		mod_delayed_work(system_wq, &port_priv->cfg_work, 0);
+
+		/* The setup may have completed before the data was queued */
+		smp_mb();
+		if (!READ_ONCE(port_priv->cfg_pending))
+			usb_serial_generic_write_start(port, GFP_ATOMIC);
+
+		return count;
+	}
+
+	ret = usb_serial_generic_write_start(port, GFP_ATOMIC);
+	if (ret)
+		return ret;
+
+	return count;
+}
+
+/*
+ * A port may hold back received data from the ldisc until one of its
+ * delimiters arrives, rx_hold_bytes are pending or rx_hold_us passed since
+ * the first pending byte, so that line or frame oriented readers are woken
+ * up once per record rather than once per URB. The data is in the flip
+ * buffer already, only the push is delayed, and rx_hold_lock serializes
+ * the insertion and the pushes from the timer.
+ */
+#define XR_RX_HOLD_MAX_BYTES	16384
+#define XR_RX_HOLD_MAX_US	1000000
+
+static void xr_rx_push(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	lockdep_assert_held(&port_priv->rx_hold_lock);
+
+	port_priv->rx_held = 0;
+	hrtimer_try_to_cancel(&port_priv->rx_hold_timer);
+	tty_flip_buffer_push(&port->port);
+	atomic64_inc(&port_priv->cnt.rx_pushes);
+}
+
+/* Returns true if the data inserted so far must be pushed now */
+static bool xr_rx_hold(struct xr_port_private *port_priv,
+		       const unsigned char *data, unsigned int len)
+{
+	unsigned int i;
+
+	lockdep_assert_held(&port_priv->rx_hold_lock);
+
+	if (!port_priv->rx_ndelim)
+		return true;
+
+	for (i = 0; i < port_priv->rx_ndelim; i++)
+		if (memchr(data, port_priv->rx_delim[i], len))
+			return true;
+
+	if (port_priv->rx_held + len >= port_priv->rx_hold_bytes)
+		return true;
+
+	if (!port_priv->rx_held && len)
+		hrtimer_start(&port_priv->rx_hold_timer,
+			      us_to_ktime(port_priv->rx_hold_us),
+			      HRTIMER_MODE_REL);
+	port_priv->rx_held += len;
+
+	return false;
+}
+
+static enum hrtimer_restart xr_rx_hold_timer(struct hrtimer *timer)
+{
+	struct xr_port_private *port_priv =
+		container_of(timer, struct xr_port_private, rx_hold_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&port_priv->rx_hold_lock, flags);
+	if (port_priv->rx_held)
+		xr_rx_push(port_priv->port);
+	spin_unlock_irqrestore(&port_priv->rx_hold_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static void xr_rx_insert(struct usb_serial_port *port,
+			 const unsigned char *data, unsigned int len)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned long flags;
+	unsigned int n;
+
+	if (!len)
+		return;
+
+	spin_lock_irqsave(&port_priv->rx_hold_lock, flags);
+
+	n = tty_insert_flip_string(&port->port, data, len);
+	if (n < len)
+		port->icount.buf_overrun += len - n;
+
+	if (xr_rx_hold(port_priv, data, n))
+		xr_rx_push(port);
+
+	spin_unlock_irqrestore(&port_priv->rx_hold_lock, flags);
+}
+
+/*
+ * RX processing normally runs in the URB completion, on whatever CPU the
+ * host controller interrupt lands. A port may instead hand its data to the
+ * driver's high priority workqueue, optionally bound to one CPU, so that
+ * the flip buffer processing of latency critical ports stays on isolated
+ * cores and isn't queued behind other ports. The ldisc itself still runs
+ * from the tty layer's own work.
+ *
+ * The port stops reading while rx_fifo couldn't take the data of the read
+ * URBs in flight, and the work restarts it once it drained the fifo. A
+ * console port keeps processing inline, for the sysrq handling.
+ */
+static void xr_rx_work(struct work_struct *work)
+{
+	struct xr_port_private *port_priv =
+		container_of(work, struct xr_port_private, rx_work);
+	struct usb_serial_port *port = port_priv->port;
+	unsigned int len, n;
+	unsigned long flags;
+	unsigned char *p;
+	bool push = false;
+
+	spin_lock_irqsave(&port_priv->rx_hold_lock, flags);
+
+	while ((len = kfifo_len(&port_priv->rx_fifo))) {
+		n = tty_prepare_flip_string(&port->port, &p, len);
+		if (!n) {
+			/* The tty buffer is full, so the data is lost */
+			port->icount.buf_overrun += len;
+			kfifo_reset_out(&port_priv->rx_fifo);
+			break;
+		}
+
+		n = kfifo_out_spinlocked(&port_priv->rx_fifo, p, n,
+					 &port_priv->rx_lock);
+		if (xr_rx_hold(port_priv, p, n))
+			push = true;
+	}
+
+	if (push)
+		xr_rx_push(port);
+
+	spin_unlock_irqrestore(&port_priv->rx_hold_lock, flags);
+
+	if (!test_and_clear_bit(XR_RX_STOP_FIFO, &port_priv->rx_stop))
+		return;
+
+	/* Matches the smp_mb__after_atomic() in xr_read_bulk_callback() */
+	smp_mb__after_atomic();
+
+	/* Not initialized any more once the port is closing */
+	if (tty_port_initialized(&port->port) && !xr_rx_stopped(port))
+		xr_rx_restart(port, GFP_KERNEL);
+}
+
+static void xr_rx_queue(struct usb_serial_port *port,
+			const unsigned char *data, unsigned int len)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int cpu = READ_ONCE(port_priv->rx_cpu);
+	unsigned int n;
+
+	if (!len)
+		return;
+
+	n = kfifo_in_spinlocked(&port_priv->rx_fifo, data, len,
+				&port_priv->rx_lock);
+	if (n < len)
+		port->icount.buf_overrun += len - n;
+
+	/* Set before the work is queued, so that it sees the bit */
+	if (kfifo_avail(&port_priv->rx_fifo) <
+	    port->bulk_in_size * ARRAY_SIZE(port->read_urbs))
+		set_bit(XR_RX_STOP_FIFO, &port_priv->rx_stop);
+
+	if (cpu >= 0 && cpu_online(cpu))
+		queue_work_on(cpu, xr_rx_wq, &port_priv->rx_work);
+	else
+		queue_work(xr_rx_wq, &port_priv->rx_work);
+}
+
+/*
+ * Two ports can be bridged, so that everything one of them receives is sent
+ * out by the other straight from the URB completion, without going through
+ * the tty layer or userspace. The bridged ports don't deliver data to their
+ * own ttys, but both must be open for the line settings to be applied.
+ *
+ * A port stops reading while its peer's write fifo can't take the data of
+ * the read URBs still in flight, and resumes from the peer's write
+ * completion once there is room again, so nothing is lost as long as both
+ * sides stay open. The bridge throttles the port with its own flag, so
+ * that it doesn't interfere with the throttling by the tty.
+ */
+static unsigned int xr_bridge_room(struct usb_serial_port *port)
+{
+	return port->bulk_in_size * ARRAY_SIZE(port->read_urbs);
+}
+
+static void xr_bridge_unthrottle(struct xr_port_private *port_priv,
+				 gfp_t mem_flags)
+{
+	struct usb_serial_port *port = port_priv->port;
+
+	if (!test_and_clear_bit(XR_RX_STOP_BRIDGE, &port_priv->rx_stop))
+		return;
+
+	/* Matches the smp_mb__after_atomic() in xr_read_bulk_callback() */
+	smp_mb__after_atomic();
+
+	if (tty_port_initialized(&port->port) && !xr_rx_stopped(port))
+		xr_rx_restart(port, mem_flags);
+}
+
+/* Returns true if the data was meant for the bridge peer */
+static bool xr_bridge_rx(struct usb_serial_port *port,
+			 const unsigned char *data, unsigned int len)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_port_private *peer;
+	struct usb_serial_port *peer_port;
+	unsigned int n = 0;
+	int ret;
+
+	rcu_read_lock();
+
+	peer = rcu_dereference(port_priv->bridge);
+	if (!peer) {
+		rcu_read_unlock();
+		return false;
+	}
+
+	peer_port = peer->port;
+	if (len && tty_port_initialized(&peer_port->port)) {
+		ret = xr_write(NULL, peer_port, data, len);
+		if (ret > 0)
+			n = ret;
+	}
+
+	atomic64_add(n, &port_priv->cnt.bridge_bytes);
+	if (n < len)
+		atomic64_add(len - n, &port_priv->cnt.bridge_drops);
+
+	if (kfifo_avail(&peer_port->write_fifo) < xr_bridge_room(port)) {
+		set_bit(XR_RX_STOP_BRIDGE, &port_priv->rx_stop);
+		atomic64_inc(&port_priv->cnt.bridge_throttles);
+
+		/* The peer may have drained before it could see the flag */
+		smp_mb__after_atomic();
+		if (kfifo_avail(&peer_port->write_fifo) >= xr_bridge_room(port))
+			xr_bridge_unthrottle(port_priv, GFP_ATOMIC);
+	}
+
+	rcu_read_unlock();
+
+	return true;
+}
+
+/* Called once a write URB of the port completed and the next one started */
+static void xr_bridge_tx_done(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_port_private *peer;
+
+	rcu_read_lock();
+
+	peer = rcu_dereference(port_priv->bridge);
+	if (peer) {
+		/* Order the fifo update against the check of the flag */
+		smp_mb();
+		if (test_bit(XR_RX_STOP_BRIDGE, &peer->rx_stop) &&
+		    kfifo_avail(&port->write_fifo) >= xr_bridge_room(peer->port))
+			xr_bridge_unthrottle(peer, GFP_ATOMIC);
+	}
+
+	rcu_read_unlock();
+}
+
+/* Nothing will drain the write fifo of a closed port, so release the peer */
+static void xr_bridge_close(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_port_private *peer;
+
+	clear_bit(XR_RX_STOP_BRIDGE, &port_priv->rx_stop);
+
+	rcu_read_lock();
+	peer = rcu_dereference(port_priv->bridge);
+	if (peer)
+		xr_bridge_unthrottle(peer, GFP_ATOMIC);
+	rcu_read_unlock();
+}
+
+static void xr_bridge_unlink(struct xr_port_private *port_priv)
+{
+	struct xr_port_private *peer;
+
+	lockdep_assert_held(&xr_port_list_lock);
+
+	peer = rcu_dereference_protected(port_priv->bridge,
+					 lockdep_is_held(&xr_port_list_lock));
+	if (!peer)
+		return;
+
+	RCU_INIT_POINTER(port_priv->bridge, NULL);
+	RCU_INIT_POINTER(peer->bridge, NULL);
+	synchronize_rcu();
+
+	xr_bridge_unthrottle(port_priv, GFP_KERNEL);
+	xr_bridge_unthrottle(peer, GFP_KERNEL);
+}
+
+static void xr_process_read_urb(struct urb *urb)
+{
+	struct usb_serial_port *port = urb->context;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned int n;
+	ktime_t start;
+	u64 ns;
+
+	if (xr_inject_rx_fault(port, urb->actual_length)) {
+		xr_bulk_account(port_priv, &port_priv->rx_fail_start,
+				XR_OP_RX_RECOVERY, true);
+		return;
+	}
+
+	xr_bulk_account(port_priv, &port_priv->rx_fail_start,
+			XR_OP_RX_RECOVERY, false);
+
+	if (READ_ONCE(port_priv->rs485_echo) && urb->actual_length) {
+		n = xr_echo_strip(port, urb->transfer_buffer,
+				  urb->actual_length);
+		if (n) {
+			urb->actual_length -= n;
+			memmove(urb->transfer_buffer, urb->transfer_buffer + n,
+				urb->actual_length);
+		}
+	}
+
+	start = ktime_get();
+	if (READ_ONCE(port_priv->ab_state) == XR_AB_RUNNING) {
+		xr_autobaud_rx(port_priv, urb->transfer_buffer,
+			       urb->actual_length);
+	} else if (!xr_bridge_rx(port, urb->transfer_buffer,
+				 urb->actual_length)) {
+		if (smp_load_acquire(&port_priv->rx_defer) && !port->sysrq) {
+			xr_rx_queue(port, urb->transfer_buffer,
+				    urb->actual_length);
+		} else if (READ_ONCE(port_priv->rx_ndelim) && !port->sysrq) {
+			xr_rx_insert(port, urb->transfer_buffer,
+				     urb->actual_length);
+		} else if (urb->actual_length) {
+			usb_serial_generic_process_read_urb(urb);
+			atomic64_inc(&port_priv->cnt.rx_pushes);
+		}
+	}
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	atomic64_inc(&port_priv->cnt.rx_urbs);
+	atomic64_add(urb->actual_length, &port_priv->cnt.rx_bytes);
+	xr_rate_transfer(port_priv, false, urb->actual_length);
+	atomic64_add(ns, &port_priv->cnt.rx_ns);
+	xr_hist_add(&port_priv->rx_hist, ns);
+}
+
+/*
+ * None of the models reports whether its transmitter is empty, so the time
+ * the last byte leaves the UART is estimated: the data of a bulk-out
+ * transfer is in the chip FIFO once the transfer completes, and the FIFO
+ * shifts it out at one character time per byte after whatever was still
+ * queued there.
+ */
+static void xr_tx_account(struct usb_serial_port *port, unsigned int len)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned long flags;
+	ktime_t now, start;
+
+	spin_lock_irqsave(&port->lock, flags);
+
+	now = ktime_get();
+	start = ktime_after(port_priv->tx_done, now) ? port_priv->tx_done : now;
+	port_priv->tx_done = ktime_add_ns(start, len * port_priv->tx_char_ns);
+	port_priv->tx_urb_done = now;
+
+	spin_unlock_irqrestore(&port->lock, flags);
+}
+
+static bool xr_tx_pending(struct usb_serial_port *port)
+{
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&port->lock, flags);
+	pending = kfifo_len(&port->write_fifo) || port->tx_bytes;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	return pending;
+}
+
+/*
+ * Bytes not on the wire yet: the write fifo, the in-flight bulk-out URBs
+ * and what the drain estimate says is still in the chip FIFO. Nothing is
+ * read from the device, so this never blocks. It is only reported through
+ * TIOCOUTQ; chars_in_buffer stays with the generic count, as nothing would
+ * wake up tty_wait_until_sent() while the chip FIFO drains.
+ */
+static unsigned int xr_tx_queued(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned int chars;
+	unsigned long flags;
+	s64 left;
+
+	spin_lock_irqsave(&port->lock, flags);
+
+	chars = kfifo_len(&port->write_fifo) + port->tx_bytes;
+
+	left = ktime_to_ns(ktime_sub(port_priv->tx_done, ktime_get()));
+	if (left > 0 && port_priv->tx_char_ns)
+		chars += div64_u64(left + port_priv->tx_char_ns - 1,
+				   port_priv->tx_char_ns);
+
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	return chars;
+}
+
+static bool xr_tx_empty(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned long flags;
+	ktime_t done;
+
+	spin_lock_irqsave(&port->lock, flags);
+	done = port_priv->tx_done;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	return !ktime_after(done, ktime_get());
+}
+
+static int xr_tx_wait(struct usb_serial_port *port,
+		      struct xr_tx_done __user *argp)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_tx_done td;
+	unsigned long flags;
+	long timeout;
+	ktime_t done;
+
+	if (copy_from_user(&td, argp, sizeof(td)))
+		return -EFAULT;
+
+	if (td.reserved)
+		return -EINVAL;
+
+	timeout = td.timeout_ms ? msecs_to_jiffies(td.timeout_ms) :
+				  MAX_SCHEDULE_TIMEOUT;
+
+	timeout = wait_event_interruptible_timeout(port_priv->tx_wait,
+						   !xr_tx_pending(port),
+						   timeout);
+	if (timeout < 0)
+		return timeout;
+	if (!timeout)
+		return -ETIMEDOUT;
+
+	spin_lock_irqsave(&port->lock, flags);
+	done = port_priv->tx_done;
+	td.urb_ns = ktime_to_ns(port_priv->tx_urb_done);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (ktime_after(done, ktime_get())) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (schedule_hrtimeout_range(&done, 10 * NSEC_PER_USEC,
+					     HRTIMER_MODE_ABS))
+			return -EINTR;
+	}
+
+	td.done_ns = ktime_to_ns(done);
+
+	if (copy_to_user(argp, &td, sizeof(td)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * As usb_serial_generic_read_bulk_callback(), but the resubmission follows
+ * the share of the port. URBs beyond rx_urbs, like those a resume submits,
+ * stay idle once they complete.
+ */
+static void xr_read_bulk_callback(struct urb *urb)
+{
+	struct usb_serial_port *port = urb->context;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	ktime_t start = ktime_get();
+	int status = urb->status;
+	bool stopped = false;
+	unsigned int i;
+	u64 ns = 0;
+
+	for (i = 0; i < ARRAY_SIZE(port->read_urbs); i++) {
+		if (urb == port->read_urbs[i])
+			break;
+	}
+
+	/* Successful URBs are accounted once processed, killed ones not */
+	if (status && !xr_urb_killed(status))
+		xr_bulk_account(port_priv, &port_priv->rx_fail_start,
+				XR_OP_RX_RECOVERY, true);
+
+	xr_bulk_status(port_priv, status);
+
+	switch (status) {
+	case 0:
+		usb_serial_debug_data(&port->dev, __func__, urb->actual_length,
+				      urb->transfer_buffer);
+		xr_process_read_urb(urb);
+		ns = xr_rx_resubmit_ns(port_priv, urb->actual_length);
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		dev_dbg(&port->dev, "%s - urb stopped: %d\n", __func__, status);
+		stopped = true;
+		break;
+	case -EPIPE:
+		dev_err(&port->dev, "%s - urb stopped: %d\n", __func__, status);
+		stopped = true;
+		break;
+	default:
+		dev_dbg(&port->dev, "%s - nonzero urb status: %d\n", __func__,
+			status);
+		break;
+	}
+
+	/* The same barriers as the generic callback, against unthrottling */
+	smp_mb__before_atomic();
+	set_bit(i, &port->read_urbs_free);
+	smp_mb__after_atomic();
+
+	if (stopped || i >= READ_ONCE(port_priv->rx_urbs) ||
+	    xr_rx_stopped(port))
+		return;
+
+	if (ns) {
+		xr_rx_pace(port_priv, start, ns);
+		return;
+	}
+
+	xr_hist_add(&port_priv->svc_hist,
+		    ktime_to_ns(ktime_sub(ktime_get(), start)));
+	xr_submit_read_urb(port, i, GFP_ATOMIC);
+}
+
+static void xr_write_bulk_callback(struct urb *urb)
+{
+	struct usb_serial_port *port = urb->context;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	if (!xr_urb_killed(urb->status))
+		xr_bulk_account(port_priv, &port_priv->tx_fail_start,
+				XR_OP_TX_RECOVERY, urb->status);
+	xr_bulk_status(port_priv, urb->status);
+
+	if (!urb->status) {
+		atomic64_inc(&port_priv->cnt.tx_urbs);
+		atomic64_add(urb->actual_length, &port_priv->cnt.tx_bytes);
+		xr_tx_account(port, urb->actual_length);
+		xr_rate_transfer(port_priv, true, urb->actual_length);
+	}
+
+	usb_serial_generic_write_bulk_callback(urb);
+	wake_up_interruptible(&port_priv->tx_wait);
+
+	xr_bridge_tx_done(port);
+}
+
+/*
+ * Grouped transmission on several channels of one device: the data of every
+ * channel is staged in its own URB first, so that the submissions follow
+ * each other with nothing in between and usually land in the same frame.
+ */
+struct xr_group_slot {
+	struct xr_group *group;
+	struct usb_serial_port *port;
+	struct urb *urb;
+	unsigned int queued;
+	bool claimed;
+	ktime_t submitted;
+	ktime_t done;
+};
+
+struct xr_group {
+	struct completion done;
+	atomic_t pending;
+	unsigned int count;
+	struct xr_group_slot slot[XR_GROUP_MAX_CHANNELS];
+};
+
+/* Woken up as the last group transfer on a channel lets go of it */
+static DECLARE_WAIT_QUEUE_HEAD(xr_group_wait);
+
+/* Takes the data of the slot out of the in-flight count of the channel */
+static void xr_group_unqueue(struct xr_group_slot *slot)
+{
+	struct usb_serial_port *port = slot->port;
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->lock, flags);
+	port->tx_bytes -= slot->queued;
+	slot->queued = 0;
+	spin_unlock_irqrestore(&port->lock, flags);
+}
+
+static void xr_group_callback(struct urb *urb)
+{
+	struct xr_group_slot *slot = urb->context;
+	struct usb_serial_port *port = slot->port;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	slot->done = ktime_get();
+
+	if (!urb->status) {
+		atomic64_inc(&port_priv->cnt.tx_urbs);
+		atomic64_add(urb->actual_length, &port_priv->cnt.tx_bytes);
+		xr_tx_account(port, urb->actual_length);
+		xr_rate_transfer(port_priv, true, urb->actual_length);
+	}
+
+	xr_group_unqueue(slot);
+	wake_up_interruptible(&port_priv->tx_wait);
+	usb_serial_port_softint(port);
+
+	if (atomic_dec_and_test(&slot->group->pending))
+		complete(&slot->group->done);
+}
+
+/* Finds the channel and keeps it bound, see xr_port_remove() */
+static struct usb_serial_port *xr_group_get(struct usb_serial_port *port,
+					    unsigned int channel)
+{
+	struct xr_port_private *port_priv;
+	struct usb_serial_port *found = NULL;
+
+	mutex_lock(&xr_port_list_lock);
+	list_for_each_entry(port_priv, &xr_port_list, node) {
+		if (port_priv->port->serial->dev == port->serial->dev &&
+		    port_priv->channel == channel) {
+			atomic_inc(&port_priv->group_refs);
+			found = port_priv->port;
+			break;
+		}
+	}
+	mutex_unlock(&xr_port_list_lock);
+
+	return found;
+}
+
+static void xr_group_put(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	if (atomic_dec_and_test(&port_priv->group_refs))
+		wake_up_all(&xr_group_wait);
+}
+
+static int xr_group_prepare(struct xr_group_slot *slot, unsigned int len)
+{
+	struct usb_serial_port *port = slot->port;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct usb_device *udev = port->serial->dev;
+	unsigned long flags;
+	int ret;
+
+	if (!tty_port_initialized(&port->port))
+		return -EIO;
+
+	ret = xr_apply_config(port);
+	if (ret)
+		return ret;
+
+	ret = xr_tx_claim(port);
+	if (ret)
+		return ret;
+	slot->claimed = true;
+
+	/* Counted in flight like a tty write, for TIOCOUTQ and tcdrain() */
+	spin_lock_irqsave(&port->lock, flags);
+	port->tx_bytes += len;
+	spin_unlock_irqrestore(&port->lock, flags);
+	slot->queued = len;
+
+	/* Nothing else is queued on the channel, see xr_write_queue() */
+	if (READ_ONCE(port_priv->rs485_echo))
+		xr_echo_queue(port, slot->urb->transfer_buffer, len);
+
+	usb_fill_bulk_urb(slot->urb, udev,
+			  usb_sndbulkpipe(udev, port->bulk_out_endpointAddress),
+			  slot->urb->transfer_buffer, len, xr_group_callback,
+			  slot);
+
+	return 0;
+}
+
+static int xr_group_tx(struct usb_serial_port *port,
+		       struct xr_group_tx __user *argp)
+{
+	s64 min_submit = S64_MAX, max_submit = S64_MIN;
+	s64 min_done = S64_MAX, max_done = S64_MIN;
+	u64 wire_ns = 0, char_ns;
+	struct xr_group_slot *slot;
+	struct xr_group_tx *req;
+	struct xr_group *group;
+	unsigned long flags;
+	unsigned int i, j;
+	ktime_t base;
+	long timeout;
+	void *buf;
+	int ret = 0;
+
+	req = memdup_user(argp, sizeof(*req));
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	if (!req->count || req->count > XR_GROUP_MAX_CHANNELS ||
+	    req->reserved) {
+		ret = -EINVAL;
+		goto out_free_req;
+	}
+
+	for (i = 0; i < req->count; i++) {
+		if (!req->chans[i].len || req->chans[i].len > XR_GROUP_MAX_LEN) {
+			ret = -EINVAL;
+			goto out_free_req;
+		}
+
+		for (j = 0; j < i; j++) {
+			if (req->chans[j].channel == req->chans[i].channel) {
+				ret = -EINVAL;
+				goto out_free_req;
+			}
+		}
+	}
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (!group) {
+		ret = -ENOMEM;
+		goto out_free_req;
+	}
+	init_completion(&group->done);
+
+	/* Copied before any channel is claimed, as that may sleep */
+	for (i = 0; i < req->count; i++) {
+		slot = &group->slot[i];
+		slot->group = group;
+
+		slot->urb = xr_alloc_urb(GFP_KERNEL);
+		if (!slot->urb) {
+			ret = -ENOMEM;
+			goto out_free_urbs;
+		}
+
+		buf = memdup_user(u64_to_user_ptr(req->chans[i].data),
+				  req->chans[i].len);
+		if (IS_ERR(buf)) {
+			ret = PTR_ERR(buf);
+			goto out_free_urbs;
+		}
+		slot->urb->transfer_buffer = buf;
+		slot->urb->transfer_flags |= URB_FREE_BUFFER;
+	}
+
+	for (i = 0; i < req->count; i++) {
+		slot = &group->slot[i];
+
+		slot->port = xr_group_get(port, req->chans[i].channel);
+		if (!slot->port) {
+			ret = -ENODEV;
+			goto out_release;
+		}
+
+		ret = xr_group_prepare(slot, req->chans[i].len);
+		if (ret)
+			goto out_release;
+
+		/* A transfer completes once the chip took all of its data */
+		char_ns = usb_get_serial_data(slot->port->serial)->tx_char_ns;
+		wire_ns = max(wire_ns, req->chans[i].len * char_ns);
+	}
+
+	group->count = req->count;
+	atomic_set(&group->pending, group->count);
+
+	local_irq_save(flags);
+	for (i = 0; i < group->count; i++) {
+		ret = usb_submit_urb(group->slot[i].urb, GFP_ATOMIC);
+		group->slot[i].submitted = ktime_get();
+		if (ret)
+			break;
+	}
+	local_irq_restore(flags);
+
+	if (ret) {
+		/* Account for the URBs that will never complete */
+		if (atomic_sub_and_test(group->count - i, &group->pending))
+			complete(&group->done);
+	}
+
+	timeout = msecs_to_jiffies(USB_CTRL_SET_TIMEOUT) +
+		  nsecs_to_jiffies(wire_ns);
+	timeout = wait_for_completion_interruptible_timeout(&group->done,
+							    timeout);
+	if (timeout <= 0) {
+		for (i = 0; i < group->count; i++)
+			usb_kill_urb(group->slot[i].urb);
+		if (!ret)
+			ret = timeout ? timeout : -ETIMEDOUT;
+	}
+
+	if (ret)
+		goto out_release;
+
+	base = group->slot[0].submitted;
+	for (i = 0; i < group->count; i++) {
+		struct xr_group_chan *chan = &req->chans[i];
+
+		if (group->slot[i].urb->status)
+			ret = group->slot[i].urb->status;
+
+		chan->submit_ns = ktime_to_ns(ktime_sub(group->slot[i].submitted,
+							base));
+		chan->done_ns = ktime_to_ns(ktime_sub(group->slot[i].done,
+						      base));
+
+		min_submit = min(min_submit, chan->submit_ns);
+		max_submit = max(max_submit, chan->submit_ns);
+		min_done = min(min_done, chan->done_ns);
+		max_done = max(max_done, chan->done_ns);
+	}
+
+	req->submit_skew_ns = max_submit - min_submit;
+	req->done_skew_ns = max_done - min_done;
+
+out_release:
+	for (i = 0; i < XR_GROUP_MAX_CHANNELS; i++) {
+		slot = &group->slot[i];
+		if (slot->claimed) {
+			xr_group_unqueue(slot);
+			xr_tx_release(slot->port);
+		}
+		if (slot->port)
+			xr_group_put(slot->port);
+	}
+
+out_free_urbs:
+	for (i = 0; i < XR_GROUP_MAX_CHANNELS; i++)
+		xr_free_urb(group->slot[i].urb);
+	kfree(group);
+
+	if (!ret && copy_to_user(argp, req, sizeof(*req)))
+		ret = -EFAULT;
+
+out_free_req:
+	kfree(req);
+
+	return ret;
+}
+
+static int xr_ioctl(struct tty_struct *tty, unsigned int cmd,
+		    unsigned long arg)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	void __user *argp = (void __user *)arg;
+	int ret;
+
+	switch (cmd) {
+	case XR_IOC_TIMED_BREAK:
+		ret = xr_apply_config(port);
+		if (ret)
+			return ret;
+		return xr_timed_break(tty, argp);
+	case XR_IOC_TX_DONE:
+		ret = xr_apply_config(port);
+		if (ret)
+			return ret;
+		return xr_tx_wait(port, argp);
+	case XR_IOC_MCTRL_SEQ:
+		ret = xr_apply_config(port);
+		if (ret)
+			return ret;
+		return xr_mctrl_seq(port, argp);
+	case XR_IOC_GROUP_TX:
+		return xr_group_tx(port, argp);
+	case TIOCOUTQ:
+		return put_user(xr_tx_queued(port), (int __user *)argp);
+	}
+
+	return -ENOIOCTLCMD;
+}
+
+static void xr_close(struct usb_serial_port *port)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	bool pending;
+
+	WRITE_ONCE(port_priv->ab_abort, true);
+	cancel_work_sync(&port_priv->ab_work);
+	if (port_priv->ab_state == XR_AB_RUNNING)
+		port_priv->ab_state = XR_AB_FAILED;
+
+	cancel_delayed_work_sync(&port_priv->health_work);
+
+	xr_msr_watch_cd(port, false);
+	cancel_delayed_work_sync(&port_priv->msr_work);
+	cancel_delayed_work_sync(&port_priv->cfg_work);
+
+	/* Nothing reached the hardware if the setup never happened */
+	xr_cfg_lock(port_priv);
+	pending = port_priv->cfg_pending;
+	port_priv->cfg_pending = false;
+	mutex_unlock(&port_priv->cfg_lock);
+
+	/*
+	 * Before the URBs are killed, so that neither can submit them again,
+	 * and after, as a completion in between may have started them.
+	 */
+	hrtimer_cancel(&port_priv->rx_pace_timer);
+	cancel_work_sync(&port_priv->rx_work);
+	usb_serial_generic_close(port);
+	hrtimer_cancel(&port_priv->rx_pace_timer);
+	xr_bridge_close(port);
+	xr_rx_share_join(port_priv, false);
+
+	cancel_work_sync(&port_priv->rx_work);
+	clear_bit(XR_RX_STOP_FIFO, &port_priv->rx_stop);
+	if (kfifo_initialized(&port_priv->rx_fifo))
+		kfifo_reset(&port_priv->rx_fifo);
+	if (kfifo_initialized(&port_priv->echo_fifo))
+		kfifo_reset(&port_priv->echo_fifo);
+
+	hrtimer_cancel(&port_priv->rx_hold_timer);
+	port_priv->rx_held = 0;
+
+	if (!pending)
+		xr_uart_disable(port);
+}
+
+static int xr_probe(struct usb_serial *serial, const struct usb_device_id *id)
+{
+	struct usb_driver *driver = serial->type->usb_driver;
+	struct usb_interface *intf = serial->interface;
+	struct usb_endpoint_descriptor *data_ep;
+	struct usb_device *udev = serial->dev;
+	struct xr_port_private *port_priv;
+	struct usb_interface *ctrl_intf;
+	int ifnum, ctrl_ifnum;
+
+	/* Attach only data interfaces */
+	ifnum = intf->cur_altsetting->desc.bInterfaceNumber;
+	if (!(ifnum % 2))
+		return -ENODEV;
+
+	/* Control interfaces are the even numbers */
+	ctrl_ifnum = ifnum - ifnum % 2;
+
+	port_priv = kzalloc(sizeof(*port_priv), GFP_KERNEL);
+	if (!port_priv)
+		return -ENOMEM;
+
+	data_ep = &intf->cur_altsetting->endpoint[0].desc;
+	ctrl_intf = usb_ifnum_to_if(udev, ctrl_ifnum);
+
+	port_priv->control_if = usb_get_intf(ctrl_intf);
+	port_priv->model = id->driver_info;
+	port_priv->channel = data_ep->bEndpointAddress;
+	xr_init_defaults(intf, port_priv);
+
+	/* Wake up control interface */
+	pm_suspend_ignore_children(&ctrl_intf->dev, false);
+	if (driver->supports_autosuspend)
+		pm_runtime_enable(&ctrl_intf->dev);
+	else
+	    pm_runtime_set_active(&ctrl_intf->dev);
+	usb_set_serial_data(serial, port_priv);
+
+	return 0;
+}
+
+static ssize_t default_baud_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	return sysfs_emit(buf, "%u\n", port_priv->def_baud);
+}
+
+static ssize_t default_baud_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned int baud;
+
+	if (kstrtouint(buf, 0, &baud))
+		return -EINVAL;
+
+	if (baud && (baud < MIN_SPEED || baud > MAX_SPEED))
+		return -EINVAL;
+
+	port_priv->def_baud = baud;
+	port_priv->def_applied = false;
+
+	return count;
+}
+static DEVICE_ATTR_RW(default_baud);
+
+static ssize_t default_format_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	tcflag_t c = port_priv->def_cflag;
+	char parity = 'N';
+
+	if (!port_priv->def_format)
+		return sysfs_emit(buf, "\n");
+
+	if (c & PARENB) {
+		if (c & CMSPAR)
+			parity = (c & PARODD) ? 'M' : 'S';
+		else
+			parity = (c & PARODD) ? 'O' : 'E';
+	}
+
+	return sysfs_emit(buf, "%c%c%c\n", '5' + ((c & CSIZE) >> 4), parity,
+			  (c & CSTOPB) ? '2' : '1');
+}
+
+static ssize_t default_format_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	tcflag_t cflag;
+
+	if (sysfs_streq(buf, "")) {
+		port_priv->def_format = false;
+		return count;
+	}
+
+	if (xr_parse_format(buf, &cflag))
+		return -EINVAL;
+
+	port_priv->def_cflag = cflag;
+	port_priv->def_format = true;
+	port_priv->def_applied = false;
+
+	return count;
+}
+static DEVICE_ATTR_RW(default_format);
+
+static ssize_t default_flow_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	if (port_priv->def_flow < 0)
+		return sysfs_emit(buf, "\n");
+
+	return sysfs_emit(buf, "%s\n", xr_flow_names[port_priv->def_flow]);
+}
+
+static ssize_t default_flow_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int ret;
+
+	if (sysfs_streq(buf, "")) {
+		port_priv->def_flow = -1;
+		return count;
+	}
+
+	ret = sysfs_match_string(xr_flow_names, buf);
+	if (ret < 0)
+		return ret;
+
+	port_priv->def_flow = ret;
+	port_priv->def_applied = false;
+
+	return count;
+}
+static DEVICE_ATTR_RW(default_flow);
+
+static ssize_t low_latency_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	return sysfs_emit(buf, "%d\n", port_priv->low_latency);
+}
+
+static ssize_t low_latency_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	if (!xr_has_reg(port_priv, REG_LOW_LATENCY))
+		return -EOPNOTSUPP;
+
+	port_priv->low_latency = val;
+
+	return count;
+}
+static DEVICE_ATTR_RW(low_latency);
+
+static ssize_t rs485_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	return sysfs_emit(buf, "%d\n", port_priv->rs485);
+}
+
+static ssize_t rs485_store(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	port_priv->rs485 = val;
+
+	return count;
+}
+static DEVICE_ATTR_RW(rs485);
+
+static ssize_t rs485_delay_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	return sysfs_emit(buf, "%u\n", port_priv->rs485_delay);
+}
+
+static ssize_t rs485_delay_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	u8 val;
+
+	if (kstrtou8(buf, 0, &val))
+		return -EINVAL;
+
+	port_priv->rs485_delay = val;
+
+	return count;
+}
+static DEVICE_ATTR_RW(rs485_delay);
+
+static ssize_t rs485_echo_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	return sysfs_emit(buf, "%d\n", port_priv->rs485_echo);
+}
+
+static ssize_t rs485_echo_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned long flags;
+	int ret = 0;
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	xr_cfg_lock(port_priv);
+
+	if (val && !kfifo_initialized(&port_priv->echo_fifo))
+		ret = kfifo_alloc(&port_priv->echo_fifo, XR_ECHO_FIFO_SIZE,
+				  GFP_KERNEL);
+
+	if (!ret) {
+		spin_lock_irqsave(&port_priv->echo_lock, flags);
+		kfifo_reset(&port_priv->echo_fifo);
+		port_priv->echo_deadline = 0;
+		WRITE_ONCE(port_priv->rs485_echo, val);
+		spin_unlock_irqrestore(&port_priv->echo_lock, flags);
+	}
+
+	mutex_unlock(&port_priv->cfg_lock);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(rs485_echo);
+
+static int xr_rx_defer_update(struct xr_port_private *port_priv,
+			      bool workqueue, int cpu)
+{
+	bool defer = workqueue || cpu >= 0;
+	int ret = 0;
+
+	xr_cfg_lock(port_priv);
+
+	if (defer && !kfifo_initialized(&port_priv->rx_fifo))
+		ret = kfifo_alloc(&port_priv->rx_fifo, XR_RX_FIFO_SIZE,
+				  GFP_KERNEL);
+
+	if (!ret) {
+		port_priv->rx_workqueue = workqueue;
+		WRITE_ONCE(port_priv->rx_cpu, cpu);
+		/* The fifo must be visible before the completion uses it */
+		smp_store_release(&port_priv->rx_defer, defer);
+	}
+
+	mutex_unlock(&port_priv->cfg_lock);
+
+	/* Let data queued before switching back to inline mode drain */
+	if (!defer)
+		flush_work(&port_priv->rx_work);
+
+	return ret;
+}
+
+static ssize_t rx_workqueue_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	return sysfs_emit(buf, "%d\n", port_priv->rx_workqueue);
+}
+
+static ssize_t rx_workqueue_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	bool val;
+	int ret;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	ret = xr_rx_defer_update(port_priv, val, port_priv->rx_cpu);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(rx_workqueue);
+
+static ssize_t rx_cpu_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	return sysfs_emit(buf, "%d\n", port_priv->rx_cpu);
+}
+
+static ssize_t rx_cpu_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	int cpu, ret;
+
+	if (kstrtoint(buf, 0, &cpu))
+		return -EINVAL;
+
+	if (cpu < -1 || (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_possible(cpu))))
+		return -EINVAL;
+
+	ret = xr_rx_defer_update(port_priv, port_priv->rx_workqueue, cpu);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(rx_cpu);
+
+static ssize_t bridge_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_port_private *peer;
+	ssize_t ret;
+
+	rcu_read_lock();
+	peer = rcu_dereference(port_priv->bridge);
+	ret = sysfs_emit(buf, "%s\n", peer ? dev_name(&peer->port->dev) : "none");
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* Takes the name of the peer port, e.g. ttyUSB1, or "none" */
+static ssize_t bridge_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	struct xr_port_private *peer = NULL, *p;
+	int ret = 0;
+
+	mutex_lock(&xr_port_list_lock);
+
+	if (sysfs_streq(buf, "none") || sysfs_streq(buf, "")) {
+		xr_bridge_unlink(port_priv);
+		goto out;
+	}
+
+	list_for_each_entry(p, &xr_port_list, node) {
+		if (sysfs_streq(buf, dev_name(&p->port->dev))) {
+			peer = p;
+			break;
+		}
+	}
+
+	if (!peer) {
+		ret = -ENODEV;
+	} else if (peer == port_priv) {
+		ret = -EINVAL;
+	} else if (rcu_access_pointer(port_priv->bridge) ||
+		   rcu_access_pointer(peer->bridge)) {
+		ret = -EBUSY;
+	} else {
+		rcu_assign_pointer(port_priv->bridge, peer);
+		rcu_assign_pointer(peer->bridge, port_priv);
+	}
+
+out:
+	mutex_unlock(&xr_port_list_lock);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(bridge);
+
+static ssize_t rx_delimiters_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned long flags;
+	ssize_t len = 0;
+	unsigned int i;
+
+	spin_lock_irqsave(&port_priv->rx_hold_lock, flags);
+	for (i = 0; i < port_priv->rx_ndelim; i++)
+		len += sysfs_emit_at(buf, len, "%s0x%02x", i ? " " : "",
+				     port_priv->rx_delim[i]);
+	spin_unlock_irqrestore(&port_priv->rx_hold_lock, flags);
+
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+/* Takes up to XR_RX_MAX_DELIMS byte values, nothing disables the mode */
+static ssize_t rx_delimiters_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	u8 delim[XR_RX_MAX_DELIMS];
+	unsigned int ndelim = 0;
+	char *str, *p, *tok;
+	unsigned long flags;
+	int ret = 0;
+
+	str = kstrndup(buf, count, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	p = str;
+	while ((tok = strsep(&p, " ,\t\n"))) {
+		if (!*tok)
+			continue;
+
+		if (ndelim == XR_RX_MAX_DELIMS ||
+		    kstrtou8(tok, 0, &delim[ndelim])) {
+			ret = -EINVAL;
+			break;
+		}
+		ndelim++;
+	}
+
+	kfree(str);
+	if (ret)
+		return ret;
+
+	spin_lock_irqsave(&port_priv->rx_hold_lock, flags);
+	memcpy(port_priv->rx_delim, delim, sizeof(delim));
+	WRITE_ONCE(port_priv->rx_ndelim, ndelim);
+	/* Don't leave data behind when the mode is disabled */
+	if (!ndelim && port_priv->rx_held)
+		xr_rx_push(port);
+	spin_unlock_irqrestore(&port_priv->rx_hold_lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(rx_delimiters);
+
+static ssize_t rx_hold_bytes_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	return sysfs_emit(buf, "%u\n", port_priv->rx_hold_bytes);
+}
+
+static ssize_t rx_hold_bytes_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned long flags;
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || !val || val > XR_RX_HOLD_MAX_BYTES)
+		return -EINVAL;
+
+	spin_lock_irqsave(&port_priv->rx_hold_lock, flags);
+	port_priv->rx_hold_bytes = val;
+	spin_unlock_irqrestore(&port_priv->rx_hold_lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(rx_hold_bytes);
+
+static ssize_t rx_hold_us_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	return sysfs_emit(buf, "%u\n", port_priv->rx_hold_us);
+}
+
+static ssize_t rx_hold_us_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned long flags;
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || !val || val > XR_RX_HOLD_MAX_US)
+		return -EINVAL;
+
+	spin_lock_irqsave(&port_priv->rx_hold_lock, flags);
+	port_priv->rx_hold_us = val;
+	spin_unlock_irqrestore(&port_priv->rx_hold_lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(rx_hold_us);
+
+static ssize_t rx_urbs_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	return sysfs_emit(buf, "%u\n", port_priv->rx_urbs);
+}
+
+static ssize_t rx_urbs_store(struct device *dev,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned int val, i;
+
+	if (kstrtouint(buf, 0, &val) || !val ||
+	    val > ARRAY_SIZE(port->read_urbs))
+		return -EINVAL;
+
+	WRITE_ONCE(port_priv->rx_urbs, val);
+
+	if (!tty_port_initialized(&port->port))
+		return count;
 
-	ret = xr_set_reg_uart(port, RX_CLOCK_MASK_1,
-			      (rx_mask >>  8) & 0xff);
-	if (ret)
-		return ret;
+	/* Retire the URBs above the new number, or start the new ones */
+	for (i = val; i < ARRAY_SIZE(port->read_urbs); i++)
+		usb_unlink_urb(port->read_urbs[i]);
 
-	tty_encode_baud_rate(tty, baud, baud);
+	if (!xr_rx_stopped(port))
+		xr_rx_restart(port, GFP_KERNEL);
 
-	return 0;
+	return count;
 }
+static DEVICE_ATTR_RW(rx_urbs);
 
-static void xr_set_flow_mode(struct tty_struct *tty,
-			     struct usb_serial_port *port,
-			     struct ktermios *old_termios)
+static ssize_t rx_urb_size_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
 {
+	struct usb_serial_port *port = to_usb_serial_port(dev);
 	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	u8 flow, gpio_mode;
-	int ret;
-
-	ret = xr_get_reg_uart(port, xr_hal_table[port_priv->model][REG_GPIO_MODE], &gpio_mode);
-	if (ret)
-		return;
 
-	/* Set GPIO mode for controlling the pins manually by default. */
-	gpio_mode &= ~UART_MODE_GPIO_MASK;
+	return sysfs_emit(buf, "%u\n", port_priv->rx_urb_size);
+}
 
-	if (C_CRTSCTS(tty) && C_BAUD(tty) != B0) {
-		dev_dbg(&port->dev, "Enabling hardware flow ctrl\n");
-		gpio_mode |= UART_MODE_RTS_CTS;
-		flow = UART_FLOW_MODE_HW;
-	} else if (I_IXON(tty)) {
-		u8 start_char = START_CHAR(tty);
-		u8 stop_char = STOP_CHAR(tty);
+/* Whole packets only, a short buffer would overflow on a full one */
+static ssize_t rx_urb_size_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned int val, maxp;
 
-		dev_dbg(&port->dev, "Enabling sw flow ctrl\n");
-		flow = UART_FLOW_MODE_SW;
+	maxp = usb_maxpacket(port->serial->dev, port->read_urbs[0]->pipe, 0);
 
-		xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_XON_CHAR], start_char);
-		xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_XOFF_CHAR], stop_char);
-	} else {
-		dev_dbg(&port->dev, "Disabling flow ctrl\n");
-		flow = UART_FLOW_MODE_NONE;
-	}
+	if (kstrtouint(buf, 0, &val) || !val || val > port->bulk_in_size ||
+	    !maxp || val % maxp)
+		return -EINVAL;
 
-	/*
-	 * Add support for the TXT and RXT function for 0x1420, 0x1422, 0x1424,
-	 * by setting GPIO_MODE [9:8] = '11'
-	 */
-	if (port_priv->model == XR21B142X)
-		gpio_mode |= 0x300;
+	/* Takes effect on the next submission */
+	WRITE_ONCE(port_priv->rx_urb_size, val);
 
-	/*
-	 * As per the datasheet, UART needs to be disabled while writing to
-	 * FLOW_CONTROL register.
-	 */
-	xr_uart_disable(port);
-	xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_FLOW_CTRL], flow);
-	xr_uart_enable(port);
+	return count;
+}
+static DEVICE_ATTR_RW(rx_urb_size);
 
-	xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_GPIO_MODE], gpio_mode);
+static ssize_t rx_pace_us_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
 
-	if (C_BAUD(tty) == B0)
-		xr_dtr_rts(port, 0);
-	else if (old_termios && (old_termios->c_cflag & CBAUD) == B0)
-		xr_dtr_rts(port, 1);
+	return sysfs_emit(buf, "%u\n", port_priv->rx_pace_us);
 }
 
-static void xr_set_termios_cdc(struct tty_struct *tty,
-			       struct usb_serial_port *port,
-			       struct ktermios *old_termios)
+static ssize_t rx_pace_us_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
 {
-	struct ktermios *termios = &tty->termios;
-	struct usb_cdc_line_coding line = { 0 };
-	int clear, set;
-
-	line.dwDTERate = cpu_to_le32(tty_get_baud_rate(tty));
-	line.bCharFormat = termios->c_cflag & CSTOPB ? 1 : 0;
-	line.bParityType = termios->c_cflag & PARENB ?
-			   (termios->c_cflag & PARODD ? 1 : 2) +
-			   (termios->c_cflag & CMSPAR ? 2 : 0) : 0;
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned int val;
 
-	switch (C_CSIZE(tty)) {
-	case CS5:
-		line.bDataBits = 5;
-		break;
-	case CS6:
-		line.bDataBits = 6;
-		break;
-	case CS7:
-		line.bDataBits = 7;
-		break;
-	case CS8:
-	default:
-		line.bDataBits = 8;
-		break;
-	}
+	if (kstrtouint(buf, 0, &val) || val > XR_RX_PACE_MAX_US)
+		return -EINVAL;
 
-	if (!line.dwDTERate) {
-		line.dwDTERate = tty->termios.c_ospeed;
-		clear = UART_MODE_DTR;
-	} else {
-		set = UART_MODE_DTR;
-	}
+	WRITE_ONCE(port_priv->rx_pace_us, val);
 
-	if (clear || set)
-		xr_tiocmset_port(port, set, clear);
+	return count;
+}
+static DEVICE_ATTR_RW(rx_pace_us);
 
-	xr_set_flow_mode(tty, port, old_termios);
+static ssize_t rx_weight_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
 
-	xr_usb_serial_ctrl_msg(port, USB_CDC_REQ_SET_LINE_CODING, 0,
-			       &line, sizeof(line));
+	return sysfs_emit(buf, "%u\n", port_priv->rx_weight);
 }
 
-static void xr_set_termios_format_reg(struct tty_struct *tty,
-				      struct usb_serial_port *port,
-				      struct ktermios *old_termios)
+static ssize_t rx_weight_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
 {
+	struct usb_serial_port *port = to_usb_serial_port(dev);
 	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	struct ktermios *termios = &tty->termios;
-	u8 bits = 0;
+	unsigned int val;
 
-	if (!old_termios || (tty->termios.c_ospeed != old_termios->c_ospeed))
-		xr_set_baudrate(tty, port);
+	if (kstrtouint(buf, 0, &val) || !val || val > XR_RX_WEIGHT_MAX)
+		return -EINVAL;
 
-	/* For models with a private CHARACTER_FORMAT register */
+	spin_lock(&xr_rx_share_lock);
+	if (port_priv->rx_weighted)
+		xr_rx_weights += val - port_priv->rx_weight;
+	WRITE_ONCE(port_priv->rx_weight, val);
+	spin_unlock(&xr_rx_share_lock);
 
-	switch (C_CSIZE(tty)) {
-	case CS5:
-	case CS6:
-		/* CS5 and CS6 are not supported, so just restore old setting */
-		termios->c_cflag &= ~CSIZE;
-		if (old_termios)
-			termios->c_cflag |= old_termios->c_cflag & CSIZE;
-		else
-			bits |= UART_DATA_8;
-		break;
-	case CS7:
-		bits |= UART_DATA_7;
-		break;
-	case CS8:
+	return count;
+}
+static DEVICE_ATTR_RW(rx_weight);
+
+static ssize_t autobaud_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+
+	switch (READ_ONCE(port_priv->ab_state)) {
+	case XR_AB_RUNNING:
+		return sysfs_emit(buf, "running\n");
+	case XR_AB_LOCKED:
+		return sysfs_emit(buf, "locked %u\n", port_priv->ab_baud);
+	case XR_AB_FAILED:
+		return sysfs_emit(buf, "failed\n");
 	default:
-		bits |= UART_DATA_8;
-		break;
+		return sysfs_emit(buf, "idle\n");
 	}
+}
 
-	if (C_PARENB(tty)) {
-		if (C_CMSPAR(tty)) {
-			if (C_PARODD(tty))
-				bits |= UART_PARITY_MARK;
-			else
-				bits |= UART_PARITY_SPACE;
-		} else {
-			if (C_PARODD(tty))
-				bits |= UART_PARITY_ODD;
-			else
-				bits |= UART_PARITY_EVEN;
-		}
+/* Takes the listening time per rate in ms, 0 stops a running detection */
+static ssize_t autobaud_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || val > XR_AUTOBAUD_MAX_DWELL_MS)
+		return -EINVAL;
+
+	if (!val) {
+		WRITE_ONCE(port_priv->ab_abort, true);
+		flush_work(&port_priv->ab_work);
+		return count;
 	}
 
-	if (C_CSTOPB(tty))
-		bits |= UART_STOP_2;
-	else
-		bits |= UART_STOP_1;
+	if (!tty_port_initialized(&port->port))
+		return -EIO;
 
-	xr_set_reg_uart(port,
-			xr_hal_table[port_priv->model][REG_FORMAT],
-			bits);
+	if (work_busy(&port_priv->ab_work))
+		return -EBUSY;
 
-	xr_set_flow_mode(tty, port, old_termios);
+	port_priv->ab_dwell_ms = val;
+	port_priv->ab_overridden = false;
+	WRITE_ONCE(port_priv->ab_abort, false);
+	WRITE_ONCE(port_priv->ab_state, XR_AB_RUNNING);
+	queue_work(system_long_wq, &port_priv->ab_work);
+
+	return count;
 }
+static DEVICE_ATTR_RW(autobaud);
 
-static void xr_set_termios(struct tty_struct *tty,
-			   struct usb_serial_port *port,
-			   struct ktermios *old_termios)
+static ssize_t recovery_reset_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
 {
+	struct usb_serial_port *port = to_usb_serial_port(dev);
 	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
 
-	/*
-	 * Different models have different ways to setup character format:
-	 *
-	 * - XR2280X and XR21V141X have their on private register. On
-	 *   such models, 5-6 bits is not supported;
-	 * - The other models use a standard CDC register.
-	 *
-	 * As we need to do different things with regards to 5-6 bits,
-	 * the actual implementation is made on two different functions.
-	 */
-	if (xr_hal_table[port_priv->model][REG_FORMAT] == VIA_CDC_REGISTER)
-		xr_set_termios_cdc(tty, port, old_termios);
-	else
-		xr_set_termios_format_reg(tty, port, old_termios);
+	return sysfs_emit(buf, "%d\n", port_priv->recovery_reset);
 }
 
-static int xr_open(struct tty_struct *tty, struct usb_serial_port *port)
+static ssize_t recovery_reset_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
 {
+	struct usb_serial_port *port = to_usb_serial_port(dev);
 	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
-	u8 gpio_dir;
-	int ret;
+	bool val;
 
-	ret = xr_uart_enable(port);
-	if (ret) {
-		dev_err(&port->dev, "Failed to enable UART\n");
-		return ret;
-	}
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
 
-	/*
-	 * Configure DTR and RTS as outputs and RI, CD, DSR and CTS as
-	 * inputs.
-	 */
-	gpio_dir = UART_MODE_DTR | UART_MODE_RTS;
-	xr_set_reg_uart(port, xr_hal_table[port_priv->model][REG_GPIO_DIR], gpio_dir);
+	port_priv->recovery_reset = val;
 
-	ret = fifo_reset(port);
-	if (ret) {
-		dev_err(&port->dev, "Failed to reset FIFO\n");
-		return ret;
-	}
+	return count;
+}
+static DEVICE_ATTR_RW(recovery_reset);
 
+static ssize_t recovery_silent_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
 
-	/* Setup termios */
-	if (tty)
-		xr_set_termios(tty, port, NULL);
+	return sysfs_emit(buf, "%d\n", port_priv->recovery_silent);
+}
 
-	ret = usb_serial_generic_open(tty, port);
-	if (ret) {
-		xr_uart_disable(port);
-		return ret;
-	}
+static ssize_t recovery_silent_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
+	bool val;
 
-	return 0;
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	WRITE_ONCE(port_priv->recovery_silent, val);
+
+	/* Starts the periodic check, or lets it stop at the next run */
+	if (val)
+		xr_health_kick(port_priv);
+	else
+		clear_bit(XR_HEALTH_SILENT, &port_priv->health_flags);
+
+	return count;
 }
+static DEVICE_ATTR_RW(recovery_silent);
 
-static void xr_close(struct usb_serial_port *port)
+/*
+ * The defaults, low latency and RS-485 settings take effect on the next
+ * open of the port, the others immediately.
+ */
+static struct attribute *xr_port_attrs[] = {
+	&dev_attr_default_baud.attr,
+	&dev_attr_default_format.attr,
+	&dev_attr_default_flow.attr,
+	&dev_attr_low_latency.attr,
+	&dev_attr_rs485.attr,
+	&dev_attr_rs485_delay.attr,
+	&dev_attr_rs485_echo.attr,
+	&dev_attr_rx_workqueue.attr,
+	&dev_attr_rx_cpu.attr,
+	&dev_attr_bridge.attr,
+	&dev_attr_rx_delimiters.attr,
+	&dev_attr_rx_hold_bytes.attr,
+	&dev_attr_rx_hold_us.attr,
+	&dev_attr_rx_urbs.attr,
+	&dev_attr_rx_urb_size.attr,
+	&dev_attr_rx_pace_us.attr,
+	&dev_attr_rx_weight.attr,
+	&dev_attr_autobaud.attr,
+	&dev_attr_recovery_reset.attr,
+	&dev_attr_recovery_silent.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(xr_port);
+
+static int xr_port_probe(struct usb_serial_port *port)
 {
-	usb_serial_generic_close(port);
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
 
-	xr_uart_disable(port);
+	port_priv->port = port;
+	spin_lock_init(&port_priv->stats_lock);
+	init_waitqueue_head(&port_priv->tx_wait);
+
+	spin_lock_init(&port_priv->msr_lock);
+	INIT_DELAYED_WORK(&port_priv->msr_work, xr_msr_work);
+	port_priv->msr_interval = XR_MSR_POLL_MIN_MS;
+
+	mutex_init(&port_priv->cfg_lock);
+	INIT_DELAYED_WORK(&port_priv->cfg_work, xr_cfg_work);
+
+	spin_lock_init(&port_priv->rx_lock);
+	INIT_WORK(&port_priv->rx_work, xr_rx_work);
+	port_priv->rx_cpu = -1;
+
+	spin_lock_init(&port_priv->rx_hold_lock);
+	hrtimer_init(&port_priv->rx_hold_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	port_priv->rx_hold_timer.function = xr_rx_hold_timer;
+	port_priv->rx_hold_bytes = 4096;
+	port_priv->rx_hold_us = 10000;
+
+	hrtimer_init(&port_priv->rx_pace_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	port_priv->rx_pace_timer.function = xr_rx_pace_timer;
+	port_priv->rx_urbs = ARRAY_SIZE(port->read_urbs);
+	port_priv->rx_urb_size = port->bulk_in_size;
+	port_priv->rx_weight = 10;
+
+	spin_lock_init(&port_priv->echo_lock);
+
+	INIT_WORK(&port_priv->ab_work, xr_autobaud_work);
+	INIT_DELAYED_WORK(&port_priv->health_work, xr_health_work);
+
+	port_priv->debugfs = debugfs_create_dir(dev_name(&port->dev),
+						xr_debugfs_root);
+	debugfs_create_file("registers", 0400, port_priv->debugfs, port,
+			    &xr_registers_fops);
+	debugfs_create_file("timings", 0400, port_priv->debugfs, port,
+			    &xr_timings_fops);
+	debugfs_create_file("stats", 0400, port_priv->debugfs, port,
+			    &xr_stats_fops);
+	debugfs_create_file("latency", 0600, port_priv->debugfs, port,
+			    &xr_latency_fops);
+	debugfs_create_file("bridge", 0400, port_priv->debugfs, port,
+			    &xr_bridge_fops);
+	debugfs_create_file("health", 0400, port_priv->debugfs, port,
+			    &xr_health_fops);
+	debugfs_create_file("rates", 0400, port_priv->debugfs, port,
+			    &xr_rates_fops);
+	debugfs_create_file("echo", 0400, port_priv->debugfs, port,
+			    &xr_echo_fops);
+	xr_fault_debugfs_init(port_priv);
+
+	mutex_lock(&xr_port_list_lock);
+	list_add_tail(&port_priv->node, &xr_port_list);
+	mutex_unlock(&xr_port_list_lock);
+
+	return 0;
 }
 
-static int xr_probe(struct usb_serial *serial, const struct usb_device_id *id)
+static void xr_port_remove(struct usb_serial_port *port)
 {
-	struct usb_driver *driver = serial->type->usb_driver;
-	struct usb_interface *intf = serial->interface;
-	struct usb_endpoint_descriptor *data_ep;
-	struct usb_device *udev = serial->dev;
-	struct xr_port_private *port_priv;
-	struct usb_interface *ctrl_intf;
-	int ifnum, ctrl_ifnum;
-
-	/* Attach only data interfaces */
-	ifnum = intf->cur_altsetting->desc.bInterfaceNumber;
-	if (!(ifnum % 2))
-		return -ENODEV;
+	struct xr_port_private *port_priv = usb_get_serial_data(port->serial);
 
-	/* Control interfaces are the even numbers */
-	ctrl_ifnum = ifnum - ifnum % 2;
+	mutex_lock(&xr_port_list_lock);
+	xr_bridge_unlink(port_priv);
+	list_del(&port_priv->node);
+	mutex_unlock(&xr_port_list_lock);
+
+	/* No group transfer may still use the channel */
+	wait_event(xr_group_wait, !atomic_read(&port_priv->group_refs));
+
+	debugfs_remove_recursive(port_priv->debugfs);
+
+	cancel_delayed_work_sync(&port_priv->msr_work);
+	cancel_delayed_work_sync(&port_priv->cfg_work);
+	cancel_work_sync(&port_priv->rx_work);
+	cancel_work_sync(&port_priv->ab_work);
+	cancel_delayed_work_sync(&port_priv->health_work);
+	hrtimer_cancel(&port_priv->rx_hold_timer);
+	hrtimer_cancel(&port_priv->rx_pace_timer);
+	kfifo_free(&port_priv->rx_fifo);
+	kfifo_free(&port_priv->echo_fifo);
+}
 
-	port_priv = kzalloc(sizeof(*port_priv), GFP_KERNEL);
-	if (!port_priv)
-		return -ENOMEM;
+/* The device lost its configuration, program it again for open ports */
+static int xr_reset_resume(struct usb_serial *serial)
+{
+	struct xr_port_private *port_priv = usb_get_serial_data(serial);
+	struct usb_serial_port *port = serial->port[0];
+	struct tty_struct *tty;
 
-	data_ep = &intf->cur_altsetting->endpoint[0].desc;
-	ctrl_intf = usb_ifnum_to_if(udev, ctrl_ifnum);
+	if (tty_port_initialized(&port->port)) {
+		tty = tty_port_tty_get(&port->port);
 
-	port_priv->control_if = usb_get_intf(ctrl_intf);
-	port_priv->model = id->driver_info;
-	port_priv->channel = data_ep->bEndpointAddress;
+		xr_cfg_lock(port_priv);
+		if (!port_priv->cfg_pending && !xr_port_program(tty, port))
+			xr_mctrl_replay(port);
+		mutex_unlock(&port_priv->cfg_lock);
 
-	/* Wake up control interface */
-	pm_suspend_ignore_children(&ctrl_intf->dev, false);
-	if (driver->supports_autosuspend)
-		pm_runtime_enable(&ctrl_intf->dev);
-	else
-	    pm_runtime_set_active(&ctrl_intf->dev);
-	usb_set_serial_data(serial, port_priv);
+		tty_kref_put(tty);
+	}
 
-	return 0;
+	return usb_serial_generic_resume(serial);
 }
 
 static void xr_disconnect(struct usb_serial *serial)
@@ -951,17 +5728,30 @@ static struct usb_serial_driver xr_device = {
 	.driver = {
 		.owner = THIS_MODULE,
 		.name =	"xr_serial",
+		.dev_groups = xr_port_groups,
 	},
 	.id_table		= id_table,
 	.num_ports		= 1,
 	.probe			= xr_probe,
 	.disconnect		= xr_disconnect,
+	.reset_resume		= xr_reset_resume,
+	.port_probe		= xr_port_probe,
+	.port_remove		= xr_port_remove,
 	.open			= xr_open,
 	.close			= xr_close,
+	.write			= xr_write,
+	.unthrottle		= xr_unthrottle,
+	.process_read_urb	= xr_process_read_urb,
+	.read_bulk_callback	= xr_read_bulk_callback,
+	.write_bulk_callback	= xr_write_bulk_callback,
+	.tx_empty		= xr_tx_empty,
 	.break_ctl		= xr_break_ctl,
+	.ioctl			= xr_ioctl,
 	.set_termios		= xr_set_termios,
 	.tiocmget		= xr_tiocmget,
 	.tiocmset		= xr_tiocmset,
+	.tiocmiwait		= xr_tiocmiwait,
+	.get_icount		= usb_serial_generic_get_icount,
 	.dtr_rts		= xr_dtr_rts
 };
 
@@ -969,7 +5759,41 @@ static struct usb_serial_driver * const serial_drivers[] = {
 	&xr_device, NULL
 };
 
-module_usb_serial_driver(serial_drivers, id_table);
+static int __init xr_init(void)
+{
+	int ret;
+
+	xr_rx_wq = alloc_workqueue("xr_serial_rx", WQ_HIGHPRI, 0);
+	if (!xr_rx_wq)
+		return -ENOMEM;
+
+	xr_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, usb_debug_root);
+	debugfs_create_file("ports", 0400, xr_debugfs_root, NULL,
+			    &xr_ports_fops);
+	debugfs_create_file("resources", 0400, xr_debugfs_root, NULL,
+			    &xr_resources_fops);
+	debugfs_create_file("shares", 0400, xr_debugfs_root, NULL,
+			    &xr_shares_fops);
+
+	ret = usb_serial_register_drivers(serial_drivers, KBUILD_MODNAME,
+					  id_table);
+	if (ret) {
+		debugfs_remove_recursive(xr_debugfs_root);
+		destroy_workqueue(xr_rx_wq);
+	}
+
+	return ret;
+}
+
+static void __exit xr_exit(void)
+{
+	usb_serial_deregister_drivers(serial_drivers);
+	debugfs_remove_recursive(xr_debugfs_root);
+	destroy_workqueue(xr_rx_wq);
+}
+
+module_init(xr_init);
+module_exit(xr_exit);
 
 MODULE_AUTHOR("Manivannan Sadhasivam <mani@kernel.org>");
 MODULE_DESCRIPTION("MaxLinear/Exar USB to Serial driver");
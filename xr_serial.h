@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: GPL-2.0+ WITH Linux-syscall-note */
+/*
+ * MaxLinear/Exar USB to Serial driver - private ioctl interface
+ */
+
+#ifndef _XR_SERIAL_H
+#define _XR_SERIAL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define XR_IOC_MAGIC		'X'
+
+/*
+ * XR_IOC_TIMED_BREAK: generate a break, keep the line marking for the
+ * mark-after-break time and then send a frame, with the whole sequence
+ * timed inside the driver.
+ *
+ * Zero break_us/mab_us select the default of the chosen mode. The LIN mode
+ * prepends the 0x55 sync byte and the DMX512 mode prepends start_code to
+ * the frame.
+ */
+#define XR_BREAK_RAW		0
+#define XR_BREAK_LIN		1
+#define XR_BREAK_DMX		2
+
+#define XR_BREAK_MAX_FRAME	1024
+
+struct xr_timed_break {
+	__u32 mode;
+	__u32 break_us;
+	__u32 mab_us;
+	__u32 start_code;
+	__u32 len;
+	__u32 reserved;
+	__u64 frame;
+};
+
+#define XR_IOC_TIMED_BREAK	_IOW(XR_IOC_MAGIC, 0x40, struct xr_timed_break)
+
+/*
+ * XR_IOC_TX_DONE: wait until all the data written so far has been shifted
+ * out of the UART, or timeout_ms passed (0 waits forever).
+ *
+ * urb_ns is the CLOCK_MONOTONIC time the last bulk-out transfer completed
+ * and done_ns the time its last stop bit is estimated to have left the
+ * UART, from the transfer sizes and the character time of the current
+ * line settings.
+ */
+struct xr_tx_done {
+	__u32 timeout_ms;
+	__u32 reserved;
+	__s64 urb_ns;
+	__s64 done_ns;
+};
+
+#define XR_IOC_TX_DONE		_IOWR(XR_IOC_MAGIC, 0x41, struct xr_tx_done)
+
+/*
+ * XR_IOC_MCTRL_SEQ: drive DTR and RTS through a sequence of states, e.g. to
+ * reset a target into its bootloader. Each step asserts the TIOCM_DTR and
+ * TIOCM_RTS lines set in mctrl, deasserts the other one and holds that for
+ * delay_us before the next step; the delay of the last step is ignored.
+ *
+ * On return actual_ns is the time each step took effect, relative to the
+ * first one, and max_deviation_ns the largest difference between those
+ * times and the requested ones.
+ */
+#define XR_MCTRL_MAX_STEPS	16
+
+struct xr_mctrl_step {
+	__u32 mctrl;
+	__u32 delay_us;
+	__s64 actual_ns;
+};
+
+struct xr_mctrl_seq {
+	__u32 count;
+	__u32 reserved;
+	__s64 max_deviation_ns;
+	struct xr_mctrl_step steps[XR_MCTRL_MAX_STEPS];
+};
+
+#define XR_IOC_MCTRL_SEQ	_IOWR(XR_IOC_MAGIC, 0x42, struct xr_mctrl_seq)
+
+/*
+ * XR_IOC_GROUP_TX: send one buffer on each of up to four channels of the
+ * device the tty belongs to, with all the bulk-out transfers submitted
+ * back to back. The channels are numbered as in the debugfs stats, must be
+ * open and must have nothing else to send. Writes to those channels wait
+ * until the group transfer is done.
+ *
+ * On return submit_ns and done_ns are the submission and completion times
+ * of each channel, relative to the first channel submitted, and the skew
+ * fields the spread of those times across the channels.
+ */
+#define XR_GROUP_MAX_CHANNELS	4
+#define XR_GROUP_MAX_LEN	4096
+
+struct xr_group_chan {
+	__u32 channel;
+	__u32 len;
+	__u64 data;
+	__s64 submit_ns;
+	__s64 done_ns;
+};
+
+struct xr_group_tx {
+	__u32 count;
+	__u32 reserved;
+	__s64 submit_skew_ns;
+	__s64 done_skew_ns;
+	struct xr_group_chan chans[XR_GROUP_MAX_CHANNELS];
+};
+
+#define XR_IOC_GROUP_TX		_IOWR(XR_IOC_MAGIC, 0x43, struct xr_group_tx)
+
+/*
+ * The debugfs "registers" file of each port is a sequence of these records,
+ * one for every register that could be read.
+ */
+struct xr_reg_record {
+	__le16 reg;
+	__u8 block;
+	__u8 value;
+};
+
+#endif /* _XR_SERIAL_H */